@@ -0,0 +1,222 @@
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+#include "accel.h"
+#include "kd.h"
+#include "bvh.h"
+#include "wide.h"
+
+/**
+ * Trace a packet of rays. Backends without packet traversal trace each ray
+ * on its own.
+ * @param rays rays to trace
+ * @param count number of rays, at most PACKET_SIZE
+ * @param hits output nearest intersection for each ray
+ */
+void Accelerator::intersectPacket(const Ray* rays, int count, Hit* hits) {
+    for (int i = 0; i < count; i++) {
+        hits[i] = intersect(rays[i]);
+    }
+}
+
+/**
+ * Test a packet of ray segments for blockers. Backends without packet
+ * traversal test each ray on its own.
+ * @param rays rays to trace
+ * @param tmax length of each segment
+ * @param count number of rays, at most PACKET_SIZE
+ * @param blocked output whether each segment is blocked
+ */
+void Accelerator::occludedPacket(const Ray* rays, const float* tmax, int count, bool* blocked) {
+    for (int i = 0; i < count; i++) {
+        blocked[i] = occluded(rays[i], tmax[i]);
+    }
+}
+
+/**
+ * Update the structure after its primitives have moved, keeping its shape.
+ * Backends whose shape depends on primitive positions cannot do this.
+ * @return true if refit, false if the structure must be rebuilt instead
+ */
+bool Accelerator::refit() {
+    return false;
+}
+
+/**
+ * Write the finished structure to a cache file. Backends that cannot be
+ * cached write nothing.
+ * @param out cache file to append to
+ * @param list primitives the structure was built from
+ * @return false if the backend cannot be cached
+ */
+bool Accelerator::save(CacheWriter& out, vector<Primitive*>* list) {
+    return false;
+}
+
+/**
+ * Restore a structure written by save.
+ * @param in cache file positioned at the structure
+ * @param list primitives equal to those it was built from, in the same order
+ * @return false if the backend cannot be cached or the file is invalid
+ */
+bool Accelerator::load(CacheReader& in, vector<Primitive*>* list) {
+    return false;
+}
+
+/**
+ * Copy rays into a packet. Unused lanes repeat the first ray so SIMD tests
+ * on them stay well defined.
+ * @param packet output packet
+ * @param rays rays to copy
+ * @param count number of rays, at most PACKET_SIZE
+ * @param tmax length of each ray, or null for unbounded rays
+ */
+void initPacket(Packet& packet, const Ray* rays, int count, const float* tmax) {
+    for (int i = 0; i < PACKET_SIZE; i++) {
+        int k = i < count ? i : 0;
+        for (int a = 0; a < 3; a++) {
+            packet.origin[a][i] = rays[k].origin[a];
+            packet.invDirection[a][i] = rays[k].invDirection[a];
+        }
+        packet.tmax[i] = (tmax != nullptr) ? tmax[k] : INFINITY;
+    }
+}
+
+/**
+ * Slab test of every active ray of a packet against a box.
+ * @param box box to test
+ * @param packet rays to test
+ * @param mask bit mask of active rays
+ * @return bit mask of active rays entering the box before their nearest hit
+ */
+uint32_t intersectBox(const BoundingBox& box, const Packet& packet, uint32_t mask) {
+
+    uint32_t result = 0;
+
+#ifdef __SSE__
+
+    for (int g = 0; g < PACKET_SIZE; g += 4) {
+
+        if (((mask >> g) & 0xF) == 0) {
+            continue;
+        }
+
+        // max/min return the second operand on NaN, keeping the interval as is
+        __m128 t0 = _mm_setzero_ps();
+        __m128 t1 = _mm_load_ps(packet.tmax + g);
+
+        for (int a = 0; a < 3; a++) {
+            __m128 origin = _mm_load_ps(packet.origin[a] + g);
+            __m128 inv = _mm_load_ps(packet.invDirection[a] + g);
+            __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min[a]), origin), inv);
+            __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max[a]), origin), inv);
+            t0 = _mm_max_ps(_mm_min_ps(ta, tb), t0);
+            t1 = _mm_min_ps(_mm_max_ps(ta, tb), t1);
+        }
+
+        result |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << g;
+
+    }
+
+#else
+
+    for (int i = 0; i < PACKET_SIZE; i++) {
+
+        if (!(mask & (1u << i))) {
+            continue;
+        }
+
+        float t0 = 0;
+        float t1 = packet.tmax[i];
+
+        for (int a = 0; a < 3; a++) {
+            float ta = (box.min[a] - packet.origin[a][i]) * packet.invDirection[a][i];
+            float tb = (box.max[a] - packet.origin[a][i]) * packet.invDirection[a][i];
+            float near = ta < tb ? ta : tb;
+            float far = ta < tb ? tb : ta;
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+        }
+
+        result |= (uint32_t) (t0 <= t1) << i;
+
+    }
+
+#endif
+
+    return result & mask;
+
+}
+
+/**
+ * Build an acceleration structure of the given type.
+ * @param type backend to build
+ * @param method split plane strategy, for k-d trees
+ * @param list primitives to be contained in the structure
+ * @param pool threads to build on, or null to build serially
+ * @return new acceleration structure
+ */
+Accelerator* createAccelerator(AccelType type, SplitMethod method, vector<Primitive*>* list, ThreadPool* pool) {
+
+    switch (type) {
+
+        case ACCEL_BVH:
+            return new BVH(list, pool);
+
+        case ACCEL_BVH4:
+            return new WideBVH<4>(list, pool);
+
+        case ACCEL_BVH8:
+            return new WideBVH<8>(list, pool);
+
+        case ACCEL_KD:
+        default:
+            return new KDTree(list, method, pool);
+
+    }
+
+}
+
+/**
+ * Restore an acceleration structure from a cache file instead of building it.
+ * @param type backend that was saved
+ * @param list primitives equal to those it was built from, in the same order
+ * @param in cache file positioned at the structure
+ * @return restored structure, or null if it could not be read
+ */
+Accelerator* loadAccelerator(AccelType type, vector<Primitive*>* list, CacheReader& in) {
+
+    Accelerator* accel;
+
+    switch (type) {
+        case ACCEL_BVH: accel = new BVH(); break;
+        case ACCEL_BVH4: accel = new WideBVH<4>(); break;
+        case ACCEL_BVH8: accel = new WideBVH<8>(); break;
+        case ACCEL_KD:
+        default: accel = new KDTree(); break;
+    }
+
+    if (!accel->load(in, list)) {
+        delete accel;
+        return nullptr;
+    }
+
+    return accel;
+
+}
+
+/**
+ * @return display name of a backend
+ */
+const char* getName(AccelType type) {
+
+    switch (type) {
+        case ACCEL_BVH: return "bvh";
+        case ACCEL_BVH4: return "bvh4";
+        case ACCEL_BVH8: return "bvh8";
+        case ACCEL_KD:
+        default: return "k-d tree";
+    }
+
+}
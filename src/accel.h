@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bounding.h"
+#include "scene.h"
+
+class Primitive;
+class ThreadPool;
+class CacheWriter;
+class CacheReader;
+
+using std::vector;
+
+// maximum number of rays traced together in a packet
+#define PACKET_SIZE 16
+
+// packets with this few active rays left are split into single rays
+#define PACKET_SPLIT 2
+
+/**
+ * Packet of rays in structure of arrays form, with per-ray hit distances.
+ */
+typedef struct Packet {
+    alignas(16) float origin[3][PACKET_SIZE];
+    alignas(16) float invDirection[3][PACKET_SIZE];
+    alignas(16) float tmax[PACKET_SIZE];
+} Packet;
+
+typedef struct TreeStats {
+    size_t nodes = 0;
+    size_t leaves = 0;
+    size_t references = 0;
+    size_t depth = 0;
+    size_t bytes = 0;
+    size_t buildBytes = 0;  // temporary memory used while building, if tracked
+} TreeStats;
+
+/**
+ * Spatial index over a list of primitives answering nearest-hit and any-hit
+ * ray queries.
+ */
+class Accelerator {
+
+    public:
+        virtual ~Accelerator() = default;
+        virtual Hit intersect(const Ray& ray, float tmax = INFINITY) = 0;
+        virtual void intersectPacket(const Ray* rays, int count, Hit* hits);
+        virtual bool occluded(const Ray& ray, float tmax) = 0;
+        virtual void occludedPacket(const Ray* rays, const float* tmax, int count, bool* blocked);
+        virtual TreeStats getStats() = 0;
+        virtual bool refit();
+        virtual bool save(CacheWriter& out, vector<Primitive*>* list);
+        virtual bool load(CacheReader& in, vector<Primitive*>* list);
+
+};
+
+void initPacket(Packet& packet, const Ray* rays, int count, const float* tmax);
+uint32_t intersectBox(const BoundingBox& box, const Packet& packet, uint32_t mask);
+Accelerator* createAccelerator(AccelType type, SplitMethod method, vector<Primitive*>* list, ThreadPool* pool = nullptr);
+Accelerator* loadAccelerator(AccelType type, vector<Primitive*>* list, CacheReader& in);
+const char* getName(AccelType type);
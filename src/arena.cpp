@@ -0,0 +1,75 @@
+#include <algorithm>
+
+#include "arena.h"
+
+/**
+ * Free every block at once.
+ */
+Arena::~Arena() {
+    for (auto it = blocks.begin(); it != blocks.end(); it++) {
+        delete[] it->data;
+    }
+}
+
+/**
+ * Reserve memory from the current block, moving on to the next one when it
+ * is full. Blocks kept from before a rewind are reused if they are large
+ * enough.
+ * @param bytes size of the allocation
+ * @param align alignment of the allocation, a power of two
+ * @return start of the allocation
+ */
+void* Arena::allocate(size_t bytes, size_t align) {
+
+    if (!blocks.empty()) {
+        size_t start = (used + align - 1) & ~(align - 1);
+        if (start + bytes <= blocks[current].size) {
+            used = start + bytes;
+            return blocks[current].data + start;
+        }
+        current++;
+    }
+
+    size_t size = std::max((size_t) ARENA_BLOCK_SIZE, bytes);
+
+    if (current == blocks.size()) {
+        blocks.push_back({ new char[size], size });
+    } else if (blocks[current].size < bytes) {
+        // replace a kept block that is too small for this allocation in place,
+        // so the next kept block is not shifted into its slot unchecked
+        delete[] blocks[current].data;
+        blocks[current] = { new char[size], size };
+    }
+
+    // new[] returns memory aligned for any fundamental type
+    used = bytes;
+    return blocks[current].data;
+
+}
+
+/**
+ * @return position to rewind to later
+ */
+Arena::Mark Arena::getMark() {
+    return { current, used };
+}
+
+/**
+ * Release everything allocated since a mark, keeping the blocks.
+ * @param mark position from getMark
+ */
+void Arena::rewind(Mark mark) {
+    current = mark.block;
+    used = mark.used;
+}
+
+/**
+ * @return bytes reserved from the system
+ */
+size_t Arena::getBytes() {
+    size_t bytes = 0;
+    for (auto it = blocks.begin(); it != blocks.end(); it++) {
+        bytes += it->size;
+    }
+    return bytes;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+using std::vector;
+
+// smallest block an arena requests from the system, in bytes
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+/**
+ * Bump allocator for build temporaries. Allocation moves a pointer through
+ * large blocks, and everything is freed together when the arena is
+ * destroyed. An arena can also be rewound to an earlier mark, so that
+ * scratch buffers used like a stack share the same memory. Objects are never
+ * destructed, so only trivially destructible types should be created in it.
+ * An arena is not thread safe; give each thread its own.
+ */
+class Arena {
+
+    private:
+        struct Block {
+            char* data;
+            size_t size;
+        };
+        vector<Block> blocks;
+        size_t current = 0;
+        size_t used = 0;
+
+    public:
+        typedef struct Mark {
+            size_t block;
+            size_t used;
+        } Mark;
+        Arena() = default;
+        ~Arena();
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        void* allocate(size_t bytes, size_t align);
+        Mark getMark();
+        void rewind(Mark mark);
+        size_t getBytes();
+
+        /**
+         * Allocate an uninitialized array.
+         * @param count number of elements
+         */
+        template <typename T>
+        T* allocate(size_t count) {
+            return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+        }
+
+        /**
+         * Construct an object in the arena.
+         * @param args constructor arguments
+         */
+        template <typename T, typename... Args>
+        T* create(Args&&... args) {
+            return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+
+};
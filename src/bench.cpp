@@ -0,0 +1,288 @@
+#include <cmath>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <glm/vec3.hpp>
+#include <glm/trigonometric.hpp>
+#include <glm/geometric.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "bench.h"
+#include "accel.h"
+#include "kd.h"
+#include "object.h"
+#include "instance.h"
+#include "material.h"
+#include "pool.h"
+
+using std::vector;
+
+// instances per side of the two-level benchmark grid
+#define BENCH_GRID 16
+
+/**
+ * Time a single acceleration structure build.
+ * @param prims primitives to build over
+ * @param type backend
+ * @param method split strategy
+ * @param threads worker count
+ * @return wall time in seconds
+ */
+static double timeBuild(vector<Primitive*>* prims, AccelType type, SplitMethod method, size_t threads) {
+
+    ThreadPool pool(threads);
+
+    auto start = std::chrono::steady_clock::now();
+    Accelerator* tree = createAccelerator(type, method, prims, &pool);
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    delete tree;
+    return duration;
+
+}
+
+/**
+ * Time tracing a grid of rays at a model from outside its bounds.
+ * @param tree tree to trace against
+ * @param bound bounds of the model
+ * @param size rays per side of the grid, a multiple of 4
+ * @param packets true to trace 4x4 blocks of rays as packets
+ * @param hits output number of rays that hit
+ * @return average nanoseconds per ray
+ */
+static double timeTrace(Accelerator* tree, BoundingBox bound, size_t size, bool packets, size_t& hits) {
+
+    glm::vec3 center = (bound.min + bound.max) / 2.0f;
+    glm::vec3 extent = bound.max - bound.min;
+    glm::vec3 origin = center + glm::vec3(2 * glm::length(extent), 0.1f * extent.y, 0.1f * extent.z);
+
+    Ray rays[PACKET_SIZE];
+    Hit results[PACKET_SIZE];
+
+    hits = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t by = 0; by < size; by += 4) {
+        for (size_t bx = 0; bx < size; bx += 4) {
+
+            int count = 0;
+            for (size_t i = by; i < by + 4; i++) {
+                for (size_t j = bx; j < bx + 4; j++) {
+                    glm::vec3 target = glm::vec3(center.x, bound.min.y + extent.y * (j + 0.5f) / size, bound.min.z + extent.z * (i + 0.5f) / size);
+                    rays[count++] = Ray(origin, glm::normalize(target - origin));
+                }
+            }
+
+            if (packets) {
+                tree->intersectPacket(rays, count, results);
+            } else {
+                for (int k = 0; k < count; k++) {
+                    results[k] = tree->intersect(rays[k]);
+                }
+            }
+
+            for (int k = 0; k < count; k++) {
+                hits += results[k].object != nullptr;
+            }
+
+        }
+    }
+
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return duration * 1e9 / (size * size);
+
+}
+
+/**
+ * Time shadow rays from the visible surface of a model to a light above it.
+ * @param tree tree to trace against
+ * @param bound bounds of the model
+ * @param size rays per side of the primary grid
+ * @param anyHit true to use occlusion queries, false to find the nearest hit
+ * @param packets true to test runs of neighbouring shadow rays as packets,
+ *        with occlusion queries
+ * @param blocked output number of shadow rays that were blocked
+ * @return average nanoseconds per shadow ray
+ */
+static double timeShadow(Accelerator* tree, BoundingBox bound, size_t size, bool anyHit, bool packets, size_t& blocked) {
+
+    glm::vec3 center = (bound.min + bound.max) / 2.0f;
+    glm::vec3 extent = bound.max - bound.min;
+    glm::vec3 origin = center + glm::vec3(2 * glm::length(extent), 0.1f * extent.y, 0.1f * extent.z);
+    glm::vec3 light = center + glm::vec3(extent.x, -extent.y, 2 * extent.z);
+    float offset = 0.001f * glm::length(extent);
+
+    // shadow ray origins, backed off the surface towards the eye
+    vector<glm::vec3> points;
+    for (size_t i = 0; i < size; i++) {
+        for (size_t j = 0; j < size; j++) {
+            glm::vec3 target = glm::vec3(center.x, bound.min.y + extent.y * (j + 0.5f) / size, bound.min.z + extent.z * (i + 0.5f) / size);
+            glm::vec3 direction = glm::normalize(target - origin);
+            Hit hit = tree->intersect(Ray(origin, direction));
+            if (hit.object != nullptr) {
+                points.push_back(hit.point - offset * direction);
+            }
+        }
+    }
+
+    blocked = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    Ray rays[PACKET_SIZE];
+    float lengths[PACKET_SIZE];
+    bool results[PACKET_SIZE];
+
+    for (size_t first = 0; first < points.size(); first += PACKET_SIZE) {
+
+        int count = (int) std::min(points.size() - first, (size_t) PACKET_SIZE);
+        for (int k = 0; k < count; k++) {
+            glm::vec3& point = points[first + k];
+            lengths[k] = glm::length(light - point);
+            rays[k] = Ray(point, (light - point) / lengths[k]);
+        }
+
+        if (anyHit && packets) {
+            tree->occludedPacket(rays, lengths, count, results);
+        } else if (anyHit) {
+            for (int k = 0; k < count; k++) {
+                results[k] = tree->occluded(rays[k], lengths[k]);
+            }
+        } else {
+            for (int k = 0; k < count; k++) {
+                Hit hit = tree->intersect(rays[k]);
+                results[k] = hit.object != nullptr && glm::length(hit.point - rays[k].origin) < lengths[k];
+            }
+        }
+
+        for (int k = 0; k < count; k++) {
+            blocked += results[k];
+        }
+
+    }
+
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return duration * 1e9 / std::max((size_t) 1, points.size());
+
+}
+
+/**
+ * Compare build time against thread count, memory and trace throughput of
+ * each acceleration structure for a PLY model.
+ * @param filename model to load
+ * @return process exit code
+ */
+int benchmark(std::string filename) {
+
+    Phong *phong = new Phong(glm::vec3(.5f, .5f, 1), glm::vec3(1), 10.0f);
+    Mesh *mesh = new Mesh(glm::vec3(0), glm::vec3(glm::radians(90.0f), glm::radians(90.0f), 0), glm::vec3(30), phong);
+    mesh->read(filename);
+    vector<Primitive*>* prims = mesh->getPrimitives();
+
+    // powers of two up to the hardware thread count, plus the count itself
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    vector<size_t> counts;
+    for (size_t t = 1; t < hardware; t *= 2) {
+        counts.push_back(t);
+    }
+    counts.push_back(hardware);
+
+    AccelType types[] = { ACCEL_KD, ACCEL_KD, ACCEL_BVH, ACCEL_BVH4, ACCEL_BVH8 };
+    SplitMethod methods[] = { MIDPOINT, SAH, SAH, SAH, SAH };
+    const char* names[] = { "k-d tree, midpoint", "k-d tree, sah", "bvh, binned sah", "bvh4", "bvh8" };
+
+    std::cout << prims->size() << " primitives, " << hardware << " hardware threads" << std::endl;
+
+    for (int m = 0; m < 5; m++) {
+
+        double serial = 0;
+        std::cout << names[m] << " build:" << std::endl;
+
+        for (auto it = counts.begin(); it != counts.end(); it++) {
+
+            // best of three
+            double best = INFINITY;
+            for (int i = 0; i < 3; i++) {
+                best = std::min(best, timeBuild(prims, types[m], methods[m], *it));
+            }
+
+            if (*it == 1) {
+                serial = best;
+            }
+
+            std::cout << "  " << *it << " threads: " << best << " s (" << serial / best << "x)" << std::endl;
+
+        }
+
+        // single-threaded trace throughput
+        BoundingBox bound = BoundingBox();
+        for (auto it = prims->begin(); it != prims->end(); it++) {
+            bound.expand((*it)->getBounds());
+        }
+
+        size_t hits;
+        Accelerator* tree = createAccelerator(types[m], methods[m], prims);
+        TreeStats stats = tree->getStats();
+        std::cout << "  memory: " << stats.bytes / 1024 << " KB (" << stats.nodes << " nodes, "
+                  << stats.references << " primitive references)" << std::endl;
+
+        size_t tested, skipped, totalTested, totalSkipped;
+        Mailbox::getCounts(tested, skipped);
+
+        double ns = timeTrace(tree, bound, 512, false, hits);
+        std::cout << "  trace: " << ns << " ns/ray (" << hits << " hits)" << std::endl;
+
+        Mailbox::getCounts(totalTested, totalSkipped);
+        if (totalTested > tested) {
+            std::cout << "  mailboxing: skipped " << totalSkipped - skipped << " of "
+                      << totalTested + totalSkipped - tested - skipped << " primitive tests" << std::endl;
+        }
+
+        ns = timeTrace(tree, bound, 512, true, hits);
+        std::cout << "  packet trace: " << ns << " ns/ray (" << hits << " hits)" << std::endl;
+
+        ns = timeShadow(tree, bound, 512, false, false, hits);
+        std::cout << "  shadow, nearest hit: " << ns << " ns/ray (" << hits << " blocked)" << std::endl;
+
+        ns = timeShadow(tree, bound, 512, true, false, hits);
+        std::cout << "  shadow, any hit: " << ns << " ns/ray (" << hits << " blocked)" << std::endl;
+
+        ns = timeShadow(tree, bound, 512, true, true, hits);
+        std::cout << "  shadow, packet any hit: " << ns << " ns/ray (" << hits << " blocked)" << std::endl;
+        delete tree;
+
+    }
+
+    // a grid of placements of the model under one top level, moved rigidly
+    mesh->build(ACCEL_BVH, SAH, nullptr);
+    BoundingBox bound = mesh->getBounds();
+    float spacing = 1.5f * glm::length(bound.max - bound.min);
+
+    vector<Primitive*> placed;
+    for (int i = 0; i < BENCH_GRID; i++) {
+        for (int j = 0; j < BENCH_GRID; j++) {
+            placed.push_back(new Instance(mesh, glm::vec3(spacing * i, spacing * j, 0), glm::vec3(0), glm::vec3(1)));
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Accelerator* top = createAccelerator(ACCEL_BVH, SAH, &placed);
+    double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    glm::mat4 step = glm::translate(glm::mat4(1), glm::vec3(0, 0, 0.1f * spacing));
+    for (auto it = placed.begin(); it != placed.end(); it++) {
+        (*it)->transform(step);
+    }
+
+    start = std::chrono::steady_clock::now();
+    top->refit();
+    double refit = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "two levels, " << placed.size() << " instances:" << std::endl;
+    std::cout << "  top level build: " << build * 1e6 << " us, refit: " << refit * 1e6 << " us" << std::endl;
+
+    delete top;
+
+    return 0;
+
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include <string>
+
+int benchmark(std::string filename);
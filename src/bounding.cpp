@@ -39,7 +39,7 @@ void BoundingBox::expand(glm::vec3 other) {
     max = glm::max(max, other);
 }
 
-void BoundingBox::expand(BoundingBox& other) {
+void BoundingBox::expand(const BoundingBox& other) {
     min = glm::min(min, other.min);
     max = glm::max(max, other.max);
 }
@@ -14,7 +14,7 @@ class BoundingBox {
         BoundingBox(vector<glm::vec3>);
         BoundingBox(vector<BoundingBox> boxes);
         void expand(glm::vec3 other);
-        void expand(BoundingBox& other);
+        void expand(const BoundingBox& other);
         bool intersect(BoundingBox& other);
 
 };
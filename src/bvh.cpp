@@ -0,0 +1,654 @@
+#include <vector>
+#include <algorithm>
+#include <bitset>
+#include <glm/common.hpp>
+
+#include "bvh.h"
+#include "object.h"
+#include "pool.h"
+#include "cache.h"
+
+using std::vector;
+
+/**
+ * @return surface area of a box
+ */
+static float getArea(BoundingBox& box) {
+    glm::vec3 size = box.max - box.min;
+    return 2 * (size.x * size.y + size.x * size.z + size.y * size.z);
+}
+
+/**
+ * @return number of SIMD triangle tests needed for a leaf of n primitives
+ */
+static float getBlocks(uint32_t n) {
+    return (float) ((n + TRI_WIDTH - 1) / TRI_WIDTH);
+}
+
+/**
+ * Slab test of a ray against a box, limited to [0, tmax].
+ * @return true if the ray enters the box within range
+ */
+static bool intersectBox(const BoundingBox& box, const Ray& ray, float tmax) {
+
+    float t0 = 0;
+    float t1 = tmax;
+
+    for (int i = 0; i < 3; i++) {
+        float near = ((ray.sign[i] ? box.max : box.min)[i] - ray.origin[i]) * ray.invDirection[i];
+        float far = ((ray.sign[i] ? box.min : box.max)[i] - ray.origin[i]) * ray.invDirection[i];
+        // written so NaNs from 0 * inf leave the interval unchanged
+        t0 = near > t0 ? near : t0;
+        t1 = far < t1 ? far : t1;
+    }
+
+    return t0 <= t1;
+
+}
+
+/**
+ * Create a BVH of a set of primitives.
+ * @param list primitives to be contained in hierarchy
+ * @param pool threads to build subtrees on, or null to build serially
+ */
+BVH::BVH(vector<Primitive*>* list, ThreadPool* pool) {
+
+    // cache primitive bounds
+    vector<BVHPrimitive> refs = vector<BVHPrimitive>(list->size());
+    for (size_t i = 0; i < list->size(); i++) {
+        refs[i].index = i;
+        refs[i].bound = (*list)[i]->getBounds();
+        refs[i].centroid = (refs[i].bound.min + refs[i].bound.max) * 0.5f;
+    }
+
+    if (refs.empty()) {
+        return;
+    }
+
+    // build, then reorder primitives so leaves are contiguous
+    BVHBuildNode* root = new BVHBuildNode(refs, 0, refs.size(), pool, 1);
+
+    primitives.resize(refs.size());
+    for (size_t i = 0; i < refs.size(); i++) {
+        primitives[i] = (*list)[refs[i].index];
+    }
+
+    flatten(root, 1);
+    delete root;
+    geometry.build(&primitives);
+
+    stats.nodes = nodes.size();
+    stats.references = primitives.size();
+    stats.bytes = nodes.size() * sizeof(BVHNode) + primitives.size() * sizeof(Primitive*) + geometry.getBytes();
+
+}
+
+/**
+ * Append a built subtree to the node array, depth first.
+ * @param node subtree to pack
+ * @param depth depth of node
+ * @return index of the packed node
+ */
+uint32_t BVH::flatten(BVHBuildNode* node, size_t depth) {
+
+    uint32_t index = nodes.size();
+    nodes.push_back({ node->bound, node->first, node->count, (uint32_t) node->axis });
+    stats.depth = std::max(stats.depth, depth);
+
+    if (node->count > 0) {
+        Geometry::sort(primitives, node->first, node->count);
+        stats.leaves++;
+        return index;
+    }
+
+    flatten(node->children[0], depth + 1);
+    uint32_t second = flatten(node->children[1], depth + 1);
+    nodes[index].offset = second;
+    return index;
+
+}
+
+/**
+ * Recompute node bounds from the current primitive bounds, keeping the
+ * hierarchy's shape. Traversal gets slower the further primitives move from
+ * where the hierarchy was built, but stays correct.
+ * @return true, as any BVH can be refit
+ */
+bool BVH::refit() {
+
+    // children always follow their parent, so a reverse sweep sees them first
+    for (size_t i = nodes.size(); i-- > 0;) {
+
+        BVHNode& node = nodes[i];
+        node.bound = BoundingBox();
+
+        if (node.count > 0) {
+            for (uint32_t j = node.offset; j < node.offset + node.count; j++) {
+                node.bound.expand(primitives[j]->getBounds());
+            }
+        } else {
+            node.bound.expand(nodes[i + 1].bound);
+            node.bound.expand(nodes[node.offset].bound);
+        }
+
+    }
+
+    // primitive data is copied into leaves, so gather it again
+    geometry.build(&primitives);
+    return true;
+
+}
+
+/**
+ * Get size statistics for the hierarchy.
+ * @return node, leaf and reference counts and memory footprint
+ */
+TreeStats BVH::getStats() {
+    return stats;
+}
+
+/**
+ * Write the flattened hierarchy and its gathered geometry to a cache file,
+ * with the order leaves put the primitives in.
+ * @param out cache file to append to
+ * @param list primitives the hierarchy was built from
+ * @return true
+ */
+bool BVH::save(CacheWriter& out, vector<Primitive*>* list) {
+    vector<uint32_t> order;
+    getOrder(primitives, list, order);
+    out.write(stats);
+    out.writeArray(order);
+    out.writeArray(nodes);
+    geometry.save(out);
+    return true;
+}
+
+/**
+ * Restore a hierarchy written by save, checking every child and leaf range
+ * and the depth so a damaged file cannot send traversal out of bounds or
+ * past its fixed stack.
+ * @param in cache file positioned at the hierarchy
+ * @param list primitives equal to those it was built from, in the same order
+ * @return false if the file is invalid
+ */
+bool BVH::load(CacheReader& in, vector<Primitive*>* list) {
+
+    vector<uint32_t> order;
+    if (!in.read(stats) || !in.readArray(order) || !in.readArray(nodes) || !applyOrder(order, list, primitives)
+        || !geometry.load(in, &primitives)) {
+        return false;
+    }
+
+    // children follow their parents, so a node's depth is known when reached
+    vector<uint32_t> depth(nodes.size(), 0);
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        BVHNode& node = nodes[i];
+        bool valid = (node.count > 0) ? (size_t) node.offset + node.count <= primitives.size() && geometry.isSorted(node.offset, node.count)
+                                      : i + 1 < nodes.size() && node.offset > i && node.offset < nodes.size() && node.axis < 3
+                                        && depth[i] < BVH_MAX_DEPTH;
+        if (!valid) {
+            return false;
+        }
+        if (node.count == 0) {
+            depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+            depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+        }
+    }
+
+    stats.buildBytes = 0;
+    return true;
+
+}
+
+/**
+ * Perform an intersection test on the hierarchy.
+ * @param ray ray to trace
+ * @param tmax distance beyond which hits are ignored
+ * @return nearest intersection along ray, with no object if none is nearer
+ *         than tmax
+ */
+Hit BVH::intersect(const Ray& ray, float tmax) {
+
+    Hit hit;
+    hit.object = nullptr;
+
+    if (nodes.empty()) {
+        return hit;
+    }
+
+    float min = tmax;
+    traverse(ray, 0, hit, min);
+    hit.point = ray.origin + ray.direction * min;
+    hit.distance = min;
+    return hit;
+
+}
+
+/**
+ * Test whether anything lies along a ray segment, stopping at the first
+ * intersection found.
+ * @param ray ray to trace
+ * @param tmax length of the segment
+ * @return true if some primitive is hit within (0, tmax)
+ */
+bool BVH::occluded(const Ray& ray, float tmax) {
+
+    if (nodes.empty()) {
+        return false;
+    }
+
+    uint32_t stack[BVH_MAX_DEPTH];
+    int top = 0;
+    uint32_t node = 0;
+
+    while (true) {
+
+        const BVHNode& current = nodes[node];
+
+        if (intersectBox(current.bound, ray, tmax)) {
+
+            if (current.count > 0) {
+
+                if (geometry.occluded(ray, current.offset, current.count, tmax)) {
+                    return true;
+                }
+
+            } else {
+
+                // near child first, as blockers there are more likely
+                if (ray.sign[current.axis]) {
+                    stack[top++] = node + 1;
+                    node = current.offset;
+                } else {
+                    stack[top++] = current.offset;
+                    node = node + 1;
+                }
+
+                continue;
+
+            }
+
+        }
+
+        if (top == 0) {
+            return false;
+        }
+
+        node = stack[--top];
+
+    }
+
+}
+
+/**
+ * Trace a single ray through a subtree, visiting the child on the near side
+ * of each split first and culling boxes beyond the nearest hit.
+ * @param ray ray to trace
+ * @param node index of subtree root
+ * @param hit nearest hit so far, updated in place
+ * @param min distance to nearest hit so far, updated in place
+ */
+void BVH::traverse(const Ray& ray, uint32_t node, Hit& hit, float& min) {
+
+    uint32_t stack[BVH_MAX_DEPTH];
+    int top = 0;
+
+    while (true) {
+
+        const BVHNode& current = nodes[node];
+
+        if (intersectBox(current.bound, ray, min)) {
+
+            if (current.count > 0) {
+
+                // find closest intersection in leaf
+                geometry.intersect(ray, current.offset, current.count, min, hit);
+
+            } else {
+
+                // defer the far child
+                if (ray.sign[current.axis]) {
+                    stack[top++] = node + 1;
+                    node = current.offset;
+                } else {
+                    stack[top++] = current.offset;
+                    node = node + 1;
+                }
+
+                continue;
+
+            }
+
+        }
+
+        if (top == 0) {
+            break;
+        }
+
+        node = stack[--top];
+
+    }
+
+}
+
+/**
+ * Trace a packet of rays together. Each node's box is tested against every
+ * active ray at once, and rays that miss drop out of the packet for that
+ * subtree. Once few rays remain active they finish the subtree one by one.
+ * @param rays rays to trace
+ * @param count number of rays, at most PACKET_SIZE
+ * @param hits output nearest intersection for each ray
+ */
+void BVH::intersectPacket(const Ray* rays, int count, Hit* hits) {
+
+    typedef struct Entry {
+        uint32_t node;
+        uint32_t mask;
+    } Entry;
+
+    Packet packet;
+    initPacket(packet, rays, count, nullptr);
+
+    for (int i = 0; i < count; i++) {
+        hits[i] = Hit();
+    }
+
+    if (nodes.empty()) {
+        return;
+    }
+
+    Entry stack[BVH_MAX_DEPTH];
+    int top = 0;
+    uint32_t node = 0;
+    uint32_t mask = (count >= 32) ? ~0u : (1u << count) - 1;
+
+    while (true) {
+
+        const BVHNode& current = nodes[node];
+        uint32_t active = intersectBox(current.bound, packet, mask);
+
+        if (active != 0 && std::bitset<32>(active).count() <= PACKET_SPLIT) {
+
+            // rays have diverged, finish this subtree individually
+            for (int i = 0; i < count; i++) {
+                if (active & (1u << i)) {
+                    traverse(rays[i], node, hits[i], packet.tmax[i]);
+                }
+            }
+
+        } else if (active != 0 && current.count > 0) {
+
+            // find closest intersection in leaf for each active ray
+            for (int i = 0; i < count; i++) {
+                if (active & (1u << i)) {
+                    geometry.intersect(rays[i], current.offset, current.count, packet.tmax[i], hits[i]);
+                }
+            }
+
+        } else if (active != 0) {
+
+            // order children by the direction of the first active ray
+            int first = 0;
+            while (!(active & (1u << first))) {
+                first++;
+            }
+
+            if (rays[first].sign[current.axis]) {
+                stack[top++] = { node + 1, active };
+                node = current.offset;
+            } else {
+                stack[top++] = { current.offset, active };
+                node = node + 1;
+            }
+
+            mask = active;
+            continue;
+
+        }
+
+        if (top == 0) {
+            break;
+        }
+
+        top--;
+        node = stack[top].node;
+        mask = stack[top].mask;
+
+    }
+
+    for (int i = 0; i < count; i++) {
+        hits[i].point = rays[i].origin + rays[i].direction * packet.tmax[i];
+        hits[i].distance = packet.tmax[i];
+    }
+
+}
+
+/**
+ * Test a packet of ray segments for blockers together. A ray leaves the
+ * packet once it is blocked, and traversal ends when every ray is.
+ * @param rays rays to trace
+ * @param tmax length of each segment
+ * @param count number of rays, at most PACKET_SIZE
+ * @param blocked output whether each segment is blocked
+ */
+void BVH::occludedPacket(const Ray* rays, const float* tmax, int count, bool* blocked) {
+
+    typedef struct Entry {
+        uint32_t node;
+        uint32_t mask;
+    } Entry;
+
+    Packet packet;
+    initPacket(packet, rays, count, tmax);
+
+    for (int i = 0; i < count; i++) {
+        blocked[i] = false;
+    }
+
+    if (nodes.empty()) {
+        return;
+    }
+
+    Entry stack[BVH_MAX_DEPTH];
+    int top = 0;
+    uint32_t node = 0;
+    uint32_t mask = (count >= 32) ? ~0u : (1u << count) - 1;
+    uint32_t open = mask;
+
+    while (true) {
+
+        const BVHNode& current = nodes[node];
+        uint32_t active = intersectBox(current.bound, packet, mask & open);
+
+        if (active != 0 && current.count > 0) {
+
+            // any hit within its segment retires a ray
+            for (int i = 0; i < count; i++) {
+                if ((active & (1u << i)) && geometry.occluded(rays[i], current.offset, current.count, tmax[i])) {
+                    blocked[i] = true;
+                    open &= ~(1u << i);
+                }
+            }
+
+            if (open == 0) {
+                return;
+            }
+
+        } else if (active != 0) {
+
+            int first = 0;
+            while (!(active & (1u << first))) {
+                first++;
+            }
+
+            if (rays[first].sign[current.axis]) {
+                stack[top++] = { node + 1, active };
+                node = current.offset;
+            } else {
+                stack[top++] = { current.offset, active };
+                node = node + 1;
+            }
+
+            mask = active;
+            continue;
+
+        }
+
+        if (top == 0) {
+            return;
+        }
+
+        top--;
+        node = stack[top].node;
+        mask = stack[top].mask;
+
+    }
+
+}
+
+/**
+ * Recursively build a hierarchy over a range of primitives, partitioning it
+ * in place at the cheapest of BVH_BINS - 1 centroid bin boundaries.
+ * @param prims primitive references, reordered by the build
+ * @param start first primitive in range
+ * @param end one past the last primitive in range
+ * @param pool threads to build subtrees on, or null
+ * @param depth depth of this node
+ */
+BVHBuildNode::BVHBuildNode(vector<BVHPrimitive>& prims, uint32_t start, uint32_t end, ThreadPool* pool, int depth) {
+
+    typedef struct Bin {
+        BoundingBox bound;
+        uint32_t count = 0;
+    } Bin;
+
+    uint32_t n = end - start;
+    BoundingBox centers = BoundingBox();
+
+    for (uint32_t i = start; i < end; i++) {
+        bound.expand(prims[i].bound);
+        centers.expand(prims[i].centroid);
+    }
+
+    // get largest axis
+    glm::vec3 size = centers.max - centers.min;
+    axis = (size.x > size.y) && (size.x > size.z) ? 0 : (size.y > size.z) ? 1 : 2;
+    uint32_t mid = start;
+
+    if (n == 1 || depth >= BVH_MAX_DEPTH) {
+
+        // recursion base case
+        first = start;
+        count = n;
+        return;
+
+    } else if (size[axis] <= 0) {
+
+        // coincident centroids, split evenly if too many for one leaf
+        if (n <= BVH_MAX_LEAF) {
+            first = start;
+            count = n;
+            return;
+        }
+
+        mid = start + n / 2;
+
+    } else {
+
+        // bin centroids
+        Bin bins[BVH_BINS];
+        float scale = BVH_BINS / size[axis];
+
+        auto binIndex = [&](const BVHPrimitive& p) {
+            return std::min(BVH_BINS - 1, (int) ((p.centroid[axis] - centers.min[axis]) * scale));
+        };
+
+        for (uint32_t i = start; i < end; i++) {
+            Bin& bin = bins[binIndex(prims[i])];
+            bin.count++;
+            bin.bound.expand(prims[i].bound);
+        }
+
+        // sweep from the right to get the cost of everything above each boundary
+        float aboveArea[BVH_BINS];
+        uint32_t aboveCount[BVH_BINS];
+        BoundingBox box = BoundingBox();
+        uint32_t total = 0;
+
+        for (int i = BVH_BINS - 1; i > 0; i--) {
+            box.expand(bins[i].bound);
+            total += bins[i].count;
+            aboveArea[i] = total > 0 ? getArea(box) : 0;
+            aboveCount[i] = total;
+        }
+
+        // then from the left, splitting after bin i
+        float area = getArea(bound);
+        float bestCost = INFINITY;
+        int bestBin = -1;
+        box = BoundingBox();
+        total = 0;
+
+        for (int i = 0; i < BVH_BINS - 1; i++) {
+
+            box.expand(bins[i].bound);
+            total += bins[i].count;
+
+            if (total == 0 || aboveCount[i + 1] == 0) {
+                continue;
+            }
+
+            float cost = BVH_TRAVERSAL_COST + (getBlocks(total) * getArea(box) + getBlocks(aboveCount[i + 1]) * aboveArea[i + 1]) / area;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestBin = i;
+            }
+
+        }
+
+        // leaf if cheaper and small enough
+        if (n <= BVH_MAX_LEAF && bestCost >= getBlocks(n)) {
+            first = start;
+            count = n;
+            return;
+        }
+
+        if (bestBin < 0) {
+
+            // no boundary has a finite cost, as when areas overflow, so split evenly
+            mid = start + n / 2;
+
+        } else {
+
+            auto split = std::partition(prims.begin() + start, prims.begin() + end, [&](const BVHPrimitive& p) {
+                return binIndex(p) <= bestBin;
+            });
+
+            mid = split - prims.begin();
+
+        }
+
+    }
+
+    // create children, forking the first subtree if it is large
+    if (pool != nullptr && n >= BVH_FORK_SIZE) {
+        TaskGroup group(*pool);
+        group.run([&] { children[0] = new BVHBuildNode(prims, start, mid, pool, depth + 1); });
+        children[1] = new BVHBuildNode(prims, mid, end, pool, depth + 1);
+        group.wait();
+    } else {
+        children[0] = new BVHBuildNode(prims, start, mid, pool, depth + 1);
+        children[1] = new BVHBuildNode(prims, mid, end, pool, depth + 1);
+    }
+
+}
+
+/**
+ * Free the subtree.
+ */
+BVHBuildNode::~BVHBuildNode() {
+    delete children[0];
+    delete children[1];
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/vec3.hpp>
+
+#include "accel.h"
+#include "bounding.h"
+#include "scene.h"
+#include "geometry.h"
+
+class Primitive;
+class ThreadPool;
+
+using std::vector;
+
+// number of centroid bins evaluated per split
+#define BVH_BINS 16
+
+// SAH cost of a box test relative to a primitive test
+#define BVH_TRAVERSAL_COST 0.125f
+
+// nodes with more primitives than this are always split
+#define BVH_MAX_LEAF 8
+
+// maximum tree depth, which bounds the traversal stack
+#define BVH_MAX_DEPTH 64
+
+// subtrees with at least this many primitives are built as separate tasks
+#define BVH_FORK_SIZE 1024
+
+/**
+ * Primitive reference used while building, with cached bounds.
+ */
+typedef struct BVHPrimitive {
+    uint32_t index;
+    BoundingBox bound;
+    glm::vec3 centroid;
+} BVHPrimitive;
+
+/**
+ * Temporary pointer-based node used while building the hierarchy. Leaves
+ * cover a contiguous range of the reordered primitive list.
+ */
+class BVHBuildNode {
+
+    public:
+        BoundingBox bound;
+        BVHBuildNode* children[2] = { nullptr, nullptr };
+        int axis = 0;
+        uint32_t first = 0;
+        uint32_t count = 0;
+        BVHBuildNode(vector<BVHPrimitive>& prims, uint32_t start, uint32_t end, ThreadPool* pool, int depth);
+        ~BVHBuildNode();
+
+};
+
+/**
+ * Flattened 32-byte hierarchy node. The first child of an interior node
+ * follows it directly and the second is at a stored index.
+ */
+typedef struct BVHNode {
+    BoundingBox bound;
+    uint32_t offset;    // leaf: first primitive; interior: second child
+    uint32_t count : 30;    // primitives in leaf, 0 for interior nodes
+    uint32_t axis : 2;      // split axis of interior nodes
+} BVHNode;
+
+static_assert(sizeof(BVHNode) == 32, "bvh nodes must stay 32 bytes");
+
+/**
+ * Bounding volume hierarchy built with binned SAH splits. Unlike the k-d
+ * tree, every primitive is referenced by exactly one leaf.
+ */
+class BVH : public Accelerator {
+
+    private:
+        vector<BVHNode> nodes;
+        vector<Primitive*> primitives;
+        Geometry geometry;
+        TreeStats stats;
+        uint32_t flatten(BVHBuildNode* node, size_t depth);
+        void traverse(const Ray& ray, uint32_t node, Hit& hit, float& min);
+
+    public:
+        BVH() = default;
+        BVH(vector<Primitive*>* list, ThreadPool* pool = nullptr);
+        virtual TreeStats getStats() override;
+        virtual Hit intersect(const Ray& ray, float tmax = INFINITY) override;
+        virtual bool occluded(const Ray& ray, float tmax) override;
+        virtual void intersectPacket(const Ray* rays, int count, Hit* hits) override;
+        virtual void occludedPacket(const Ray* rays, const float* tmax, int count, bool* blocked) override;
+        virtual bool refit() override;
+        virtual bool save(CacheWriter& out, vector<Primitive*>* list) override;
+        virtual bool load(CacheReader& in, vector<Primitive*>* list) override;
+
+};
@@ -0,0 +1,280 @@
+#include <cstdio>
+#include <unordered_map>
+
+#include "cache.h"
+#include "kd.h"
+#include "bvh.h"
+#include "wide.h"
+
+static const char CACHE_MAGIC[8] = { 'R', 'T', 'C', 'A', 'C', 'H', 'E', 0 };
+
+/**
+ * @return a 64-bit word rotated left
+ */
+static uint64_t rotate(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+/**
+ * Scramble a hash so every input bit affects every output bit.
+ */
+static uint64_t finish(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Hash a block of memory, for cache keys. Four independent lanes consume 32
+ * bytes per step so that hashing a large source file costs little next to
+ * reading it.
+ * @param data bytes to hash
+ * @param bytes length of data
+ * @param seed previous hash to chain from
+ * @return 64-bit hash
+ */
+uint64_t hashBytes(const void* data, size_t bytes, uint64_t seed) {
+
+    const uint64_t K1 = 0x9E3779B97F4A7C15ull;
+    const uint64_t K2 = 0xC2B2AE3D27D4EB4Full;
+    const char* p = (const char*) data;
+
+    uint64_t lanes[4] = { seed + K1, seed + K2, seed, seed - K1 };
+
+    for (; bytes >= 32; p += 32, bytes -= 32) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t word;
+            std::memcpy(&word, p + 8 * i, 8);
+            lanes[i] = rotate(lanes[i] + word * K2, 31) * K1;
+        }
+    }
+
+    uint64_t h = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+
+    for (; bytes > 0; p++, bytes--) {
+        h = (h ^ (uint8_t) *p) * K1;
+    }
+
+    return finish(h);
+
+}
+
+/**
+ * @return hash of the sizes and settings that stored arrays and built
+ *         structures depend on, including the host byte order, so that
+ *         retuned build costs never reuse trees built with the old ones
+ */
+static uint64_t getLayout() {
+
+    uint64_t sizes[] = {
+        sizeof(glm::vec3), sizeof(BoundingBox), sizeof(TreeStats),
+        sizeof(Node), sizeof(BVHNode), sizeof(WideNode<4>), sizeof(WideNode<8>),
+        TRI_WIDTH, BVH_BINS, BVH_MAX_LEAF, BVH_MAX_DEPTH, KD_MAX_DEPTH, KD_DEPTH_BASE
+    };
+
+    float costs[] = {
+        KD_TRAVERSAL_COST, KD_INTERSECT_COST, KD_EMPTY_BONUS, KD_DEPTH_SCALE, BVH_TRAVERSAL_COST
+    };
+
+    return hashBytes(costs, sizeof(costs), hashBytes(sizes, sizeof(sizes)));
+
+}
+
+/**
+ * @param directory directory holding cache files
+ * @param key hash of everything the cached data was made from
+ * @return path of the cache file for a key
+ */
+std::string getCachePath(std::string directory, uint64_t key) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.cache", (unsigned long long) key);
+    return directory + "/" + name;
+}
+
+/**
+ * Record the order of a structure's primitives as indices into the list it
+ * was built from, so it can be rebuilt against a fresh copy of the list.
+ * @param primitives primitives in the structure's order
+ * @param list list the structure was built from
+ * @param order output index into list of each primitive
+ */
+void getOrder(vector<Primitive*>& primitives, vector<Primitive*>* list, vector<uint32_t>& order) {
+
+    std::unordered_map<Primitive*, uint32_t> index;
+    index.reserve(list->size());
+    for (size_t i = 0; i < list->size(); i++) {
+        index[(*list)[i]] = i;
+    }
+
+    order.resize(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++) {
+        order[i] = index[primitives[i]];
+    }
+
+}
+
+/**
+ * Rebuild a structure's primitive order from stored indices.
+ * @param order index into list of each primitive
+ * @param list list to take primitives from
+ * @param primitives output primitives
+ * @return false if an index is out of range
+ */
+bool applyOrder(vector<uint32_t>& order, vector<Primitive*>* list, vector<Primitive*>& primitives) {
+
+    primitives.resize(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        if (order[i] >= list->size()) {
+            return false;
+        }
+        primitives[i] = (*list)[order[i]];
+    }
+
+    return true;
+
+}
+
+// WRITER
+
+/**
+ * Start a cache file.
+ * @param filename final path of the file
+ * @param key hash of everything the cached data is made from
+ */
+CacheWriter::CacheWriter(std::string filename, uint64_t key) : filename(filename) {
+
+    file.open(filename + ".tmp", std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return;
+    }
+
+    CacheHeader header = {};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.layout = getLayout();
+    header.key = key;
+
+    file.write((const char*) &header, sizeof(header));
+    offset = sizeof(header);
+    pad();
+
+}
+
+/**
+ * Delete the temporary file if it was never closed.
+ */
+CacheWriter::~CacheWriter() {
+    if (file.is_open()) {
+        file.close();
+        std::remove((filename + ".tmp").c_str());
+    }
+}
+
+/**
+ * @return true if the file could be created
+ */
+bool CacheWriter::isOpen() {
+    return file.is_open() && file.good();
+}
+
+/**
+ * Write zeros up to the next aligned offset.
+ */
+void CacheWriter::pad() {
+    static const char zeros[CACHE_ALIGN] = {};
+    size_t padding = (CACHE_ALIGN - offset % CACHE_ALIGN) % CACHE_ALIGN;
+    file.write(zeros, padding);
+    offset += padding;
+}
+
+/**
+ * Write a section of raw bytes.
+ * @param data start of the section
+ * @param bytes length of the section
+ */
+void CacheWriter::write(const void* data, size_t bytes) {
+    uint64_t length = bytes;
+    file.write((const char*) &length, sizeof(length));
+    offset += sizeof(length);
+    pad();
+    file.write((const char*) data, bytes);
+    offset += bytes;
+}
+
+/**
+ * Finish the file and move it into place.
+ * @return false, leaving no file behind, if any write failed
+ */
+bool CacheWriter::close() {
+
+    std::string temporary = filename + ".tmp";
+    bool written = file.good();
+    file.close();
+
+    if (!written || file.fail() || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+
+    return true;
+
+}
+
+// READER
+
+/**
+ * Open a cache file, checking it was written by a compatible build for the
+ * same key.
+ * @param filename path of the file
+ * @param key hash of everything the cached data should be made from
+ */
+CacheReader::CacheReader(std::string filename, uint64_t key) : file(filename) {
+
+    CacheHeader header;
+    if (!file.isOpen() || file.getSize() < sizeof(header)) {
+        return;
+    }
+
+    std::memcpy(&header, file.getData(), sizeof(header));
+    valid = std::memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0
+         && header.version == CACHE_VERSION && header.layout == getLayout() && header.key == key;
+
+    offset = (sizeof(header) + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+
+}
+
+/**
+ * @return true if the file exists and matches the key and this build
+ */
+bool CacheReader::isOpen() {
+    return valid;
+}
+
+/**
+ * Step to the next section.
+ * @param bytes output length of the section
+ * @return start of the section, or null if the file is truncated
+ */
+const char* CacheReader::next(size_t& bytes) {
+
+    uint64_t length;
+    if (!valid || offset + sizeof(length) > file.getSize()) {
+        return nullptr;
+    }
+
+    std::memcpy(&length, file.getData() + offset, sizeof(length));
+    offset = (offset + sizeof(length) + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+
+    if (offset > file.getSize() || length > file.getSize() - offset) {
+        return nullptr;
+    }
+
+    const char* data = file.getData() + offset;
+    offset += length;
+    bytes = length;
+    return data;
+
+}
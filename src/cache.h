@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "mapped.h"
+
+class Primitive;
+
+using std::vector;
+
+// bump whenever a stored layout or a build algorithm changes; build
+// constants and type sizes are part of the header's layout hash already
+#define CACHE_VERSION 3
+
+// alignment of every section within a cache file, in bytes
+#define CACHE_ALIGN 64
+
+/**
+ * Fixed header at the start of a cache file. The layout field is a hash of
+ * the sizes and build settings the stored arrays depend on, so files written
+ * by a differently compiled build are ignored.
+ */
+typedef struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t layout;
+    uint64_t key;
+} CacheHeader;
+
+uint64_t hashBytes(const void* data, size_t bytes, uint64_t seed = 0);
+std::string getCachePath(std::string directory, uint64_t key);
+void getOrder(vector<Primitive*>& primitives, vector<Primitive*>* list, vector<uint32_t>& order);
+bool applyOrder(vector<uint32_t>& order, vector<Primitive*>* list, vector<Primitive*>& primitives);
+
+/**
+ * Writes a cache file as a header followed by sections, each an array in
+ * its in-memory layout with a length prefix, padded so every array starts
+ * on an aligned offset. The file is written under a temporary name and
+ * renamed into place when finished, so readers never see a partial file.
+ */
+class CacheWriter {
+
+    private:
+        std::string filename;
+        std::ofstream file;
+        size_t offset = 0;
+        void pad();
+
+    public:
+        CacheWriter(std::string filename, uint64_t key);
+        ~CacheWriter();
+        CacheWriter(const CacheWriter&) = delete;
+        CacheWriter& operator=(const CacheWriter&) = delete;
+        bool isOpen();
+        void write(const void* data, size_t bytes);
+        bool close();
+
+        /**
+         * Write a single value as its own section.
+         * @param value trivially copyable value
+         */
+        template <typename T>
+        void write(const T& value) {
+            write(&value, sizeof(T));
+        }
+
+        /**
+         * Write an array as one section.
+         * @param values trivially copyable elements
+         */
+        template <typename T>
+        void writeArray(const vector<T>& values) {
+            write(values.data(), values.size() * sizeof(T));
+        }
+
+};
+
+/**
+ * Reads the sections of a mapped cache file in the order they were written.
+ * Each array is copied out with a single memcpy, with no parsing or pointer
+ * fix-ups.
+ */
+class CacheReader {
+
+    private:
+        MappedFile file;
+        size_t offset = 0;
+        bool valid = false;
+
+    public:
+        CacheReader(std::string filename, uint64_t key);
+        bool isOpen();
+        const char* next(size_t& bytes);
+
+        /**
+         * Read a section holding a single value.
+         * @param value output value
+         * @return false if the file is truncated or the section is the wrong size
+         */
+        template <typename T>
+        bool read(T& value) {
+            size_t bytes;
+            const char* data = next(bytes);
+            if (data == nullptr || bytes != sizeof(T)) {
+                return false;
+            }
+            std::memcpy(&value, data, sizeof(T));
+            return true;
+        }
+
+        /**
+         * Read a section holding an array, replacing the contents of values.
+         * @param values output array
+         * @return false if the file is truncated or the section is not a whole
+         *         number of elements
+         */
+        template <typename T>
+        bool readArray(vector<T>& values) {
+            size_t bytes;
+            const char* data = next(bytes);
+            if (data == nullptr || bytes % sizeof(T) != 0) {
+                return false;
+            }
+            values.resize(bytes / sizeof(T));
+            if (bytes > 0) {
+                std::memcpy(values.data(), data, bytes);
+            }
+            return true;
+        }
+
+};
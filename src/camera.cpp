@@ -1,25 +1,137 @@
+#include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <algorithm>
 #include <glm/trigonometric.hpp>
 #include <glm/geometric.hpp>
 #include <glm/vec2.hpp>
 
 #include "scene.h"
 #include "camera.h"
+#include "object.h"
+#include "pool.h"
+#include "accel.h"
+#include "kd.h"
+#include "image.h"
+
+/**
+ * Per-thread scratch state, padded so workers never share a cache line.
+ */
+struct alignas(64) TileScratch {
+    size_t tiles = 0;
+    size_t pixels = 0;
+    size_t samples = 0;
+    size_t refined = 0;
+};
+
+/**
+ * Film plane in world space: the direction through the upper left pixel
+ * center and the steps between neighbouring pixels.
+ */
+typedef struct Film {
+    glm::vec4 ul;
+    glm::vec4 dw;
+    glm::vec4 dh;
+} Film;
+
+/**
+ * A frame being rendered and the buffers its tile tasks share. Buffers may
+ * hold only a window of the frame's rows, with row i kept at row i % rows,
+ * so a frame can be streamed through them a band at a time.
+ */
+typedef struct Frame {
+    Scene* scene;
+    Film film;
+    size_t height;
+    size_t width;
+    size_t rows;
+    glm::vec3* hdr;
+    float* squares;
+    uint8_t* refine;
+} Frame;
+
+/**
+ * @return perceptual luminance of a color
+ */
+static float getLuminance(glm::vec3 color) {
+    return glm::dot(color, glm::vec3(0.27f, 0.67f, 0.06f));
+}
+
+/**
+ * Radical inverse of an index, the Halton sequence for a prime base.
+ * @return value in [0, 1)
+ */
+static float halton(size_t index, size_t base) {
+
+    float result = 0;
+    float f = 1.0f / base;
+
+    while (index > 0) {
+        result += f * (index % base);
+        index /= base;
+        f /= base;
+    }
+
+    return result;
+
+}
+
+/**
+ * Trace one sample of a pixel. Samples follow a Halton sequence shifted by
+ * half a pixel, so the first passes through the pixel center.
+ * @param scene scene to trace
+ * @param origin eye position
+ * @param film film plane in world space
+ * @param i pixel row
+ * @param j pixel column
+ * @param k sample index within the pixel
+ * @return radiance of the sample
+ */
+static glm::vec3 getSample(Scene& scene, glm::vec3 origin, const Film& film, size_t i, size_t j, size_t k) {
+
+    float dx = halton(k, 2) + 0.5f;
+    float dy = halton(k, 3) + 0.5f;
+    dx -= (dx >= 1.0f) ? 1.5f : 0.5f;
+    dy -= (dy >= 1.0f) ? 1.5f : 0.5f;
+
+    glm::vec3 direction = glm::vec3(film.ul + film.dw * (j + dx) + film.dh * (i + dy));
+    return scene.getPixel(origin, glm::normalize(direction), 1);
+
+}
+
+/**
+ * Relative standard error of a pixel's mean luminance.
+ * @param sum sum of sample luminances
+ * @param squares sum of squared sample luminances
+ * @param n number of samples, at least 2
+ */
+static float getError(float sum, float squares, size_t n) {
+    float mean = sum / n;
+    float variance = std::max(0.0f, (squares - sum * mean) / (n - 1));
+    return std::sqrt(variance / n) / std::max(mean, EPSILON);
+}
+
+/**
+ * @return buffer index of a pixel of a frame
+ */
+static size_t getIndex(const Frame& frame, size_t i, size_t j) {
+    return (i % frame.rows) * frame.width + j;
+}
 
 Camera::Camera(glm::vec3 position, glm::vec3 lookat, glm::vec3 up, ToneOperator* tone) {
 
     this->position = position;
-    this->tone = tone;
+    this->tone = (tone != nullptr) ? tone : new LinearModel();
     
     glm::vec3 n = glm::normalize(lookat - position);
     glm::vec3 u = glm::normalize(glm::cross(up, n));
     glm::vec3 v = glm::cross(n, u);
 
-    // camera transform matrix
-    m = glm::mat4(u.x, v.x, n.x, 0,
-                  u.y, v.y, n.y, 0,
-                  u.z, v.z, n.z, 0,
-                  -glm::dot(position, u), -glm::dot(position, v), -glm::dot(position, n), 1);
+    // camera to world transform, so rays can be traced against the scene as placed
+    toWorld = glm::mat4(u.x, u.y, u.z, 0,
+                        v.x, v.y, v.z, 0,
+                        n.x, n.y, n.z, 0,
+                        position.x, position.y, position.z, 1);
 
     // hardcoded parameters for now
     this->fov = glm::radians(30.0f);
@@ -28,24 +140,67 @@ Camera::Camera(glm::vec3 position, glm::vec3 lookat, glm::vec3 up, ToneOperator*
 }
 
 /**
- * Render a scene.
+ * Set the number of render threads.
+ * @param threads thread count, or 0 to use every hardware thread
+ */
+void Camera::setThreads(size_t threads) {
+    this->threads = threads;
+}
+
+/**
+ * Set the number of primary rays traced together. Packets cover 2x2, 4x2
+ * or 4x4 pixel blocks; other sizes round down to the nearest of these.
+ * @param size 1, 4, 8 or 16
+ */
+void Camera::setPacketSize(size_t size) {
+    this->packet = (size >= 16) ? 16 : (size >= 8) ? 8 : (size >= 4) ? 4 : 1;
+}
+
+/**
+ * Set up adaptive anti-aliasing. Every pixel gets a base number of samples.
+ * Pixels whose samples disagree, or whose luminance contrasts with a
+ * neighbour's, by more than the threshold then take twice as many samples
+ * per round until their estimate settles or they reach the maximum.
+ * @param base samples for every pixel; 1 traces through the pixel center
+ * @param max most samples for any pixel, which bounds the render time
+ * @param threshold largest acceptable relative error or contrast, which
+ *        sets the quality; smaller values refine more pixels
+ */
+void Camera::setSampling(size_t base, size_t max, float threshold) {
+    this->baseSamples = std::max((size_t) 1, base);
+    this->maxSamples = std::max(baseSamples, max);
+    this->threshold = threshold;
+}
+
+/**
+ * Render a scene. Rays are traced in world space, so the scene's tree is
+ * built on the first render and reused by any camera after that; the scene
+ * keeps it until released. Use a RenderSession to render many frames
+ * without this setup.
  * @param height height of image in pixels
  * @param width width of image in pixels
  * @param scene scene to render
  */
-glm::vec3* Camera::render(size_t height, size_t width, Scene scene) {
-
-    vector<Primitive*>* prims = scene.getPrimitives();
+glm::vec3* Camera::render(size_t height, size_t width, Scene& scene) {
 
-    // transform scene to camera space    
-    scene.transform(m);
-    position = m * glm::vec4(position, 0);
+    ThreadPool pool(threads);
 
     // create k-d tree
-    scene.generateTree(prims);
+    if (!scene.hasTree()) {
+        scene.generateTree(scene.getPrimitives(), &pool);
+    }
 
-    // create framebuffer
-    glm::vec3* hdr = new glm::vec3[height * width];
+    return render(height, width, scene, pool);
+
+}
+
+/**
+ * Find the film plane for an image size.
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @return film plane in world space
+ */
+Film Camera::getFilm(size_t height, size_t width) {
 
     // define film plane
     glm::vec3 center = glm::vec3(0, 0, length);
@@ -61,23 +216,391 @@ glm::vec3* Camera::render(size_t height, size_t width, Scene scene) {
     ul -= (float(width) / 2 - 0.5f) * dw;
     ul -= (float(height) / 2 - 0.5f) * dh;
 
+    // rotate the film plane into world space
+    return { toWorld * ul, toWorld * dw, toWorld * dh };
+
+}
+
+/**
+ * Trace the base samples of a tile. Each tile writes a disjoint region of
+ * the frame.
+ * @param frame frame being rendered
+ * @param x first column of the tile
+ * @param y first row of the tile
+ * @param local scratch state of the calling thread
+ */
+void Camera::traceTile(Frame& frame, size_t x, size_t y, TileScratch& local) {
+
+    Scene& scene = *frame.scene;
+    const Film& film = frame.film;
+    bool adaptive = maxSamples > baseSamples;
+    size_t ymax = std::min(y + TILE_SIZE, frame.height);
+    size_t xmax = std::min(x + TILE_SIZE, frame.width);
+
+    // packet block shape, never more rays than a packet holds
+    size_t bw = (packet >= 4) ? (packet >= 16 ? 4 : packet / 2) : 1;
+    size_t bh = std::min((packet >= 4) ? packet / bw : 1, PACKET_SIZE / bw);
+
+    Ray rays[PACKET_SIZE];
+    Hit hits[PACKET_SIZE];
+
+    // trace primary rays for each block together, then shade
+    for (size_t by = y; by < ymax; by += bh) {
+        for (size_t bx = x; bx < xmax; bx += bw) {
+
+            int count = 0;
+            for (size_t i = by; i < std::min(by + bh, ymax); i++) {
+                for (size_t j = bx; j < std::min(bx + bw, xmax); j++) {
+                    rays[count++] = Ray(position, glm::normalize(glm::vec3(film.ul + film.dw * float(j) + film.dh * float(i))));
+                }
+            }
+
+            scene.cast(rays, count, hits);
+
+            count = 0;
+            for (size_t i = by; i < std::min(by + bh, ymax); i++) {
+                for (size_t j = bx; j < std::min(bx + bw, xmax); j++) {
+
+                    glm::vec3 color = scene.shade(hits[count], position, rays[count].direction, 1);
+                    size_t p = getIndex(frame, i, j);
+                    count++;
+
+                    if (baseSamples == 1 && !adaptive) {
+                        frame.hdr[p] = color;
+                        continue;
+                    }
+
+                    // the packet traced the center sample, trace the rest alone
+                    glm::vec3 sum = color;
+                    float l = getLuminance(color);
+                    float square = l * l;
+                    for (size_t k = 1; k < baseSamples; k++) {
+                        color = getSample(scene, position, film, i, j, k);
+                        l = getLuminance(color);
+                        sum += color;
+                        square += l * l;
+                    }
+
+                    frame.hdr[p] = sum / float(baseSamples);
+                    if (adaptive) {
+                        frame.squares[p] = square;
+                    }
+
+                }
+            }
+
+        }
+    }
+
+    local.tiles++;
+    local.pixels += (ymax - y) * (xmax - x);
+    local.samples += (ymax - y) * (xmax - x) * baseSamples;
+
+}
+
+/**
+ * Choose the pixels of a band of rows to refine. Reads the base samples of
+ * the rows above and below, so it must run before either is refined.
+ * @param frame frame being rendered
+ * @param y first row of the band
+ * @param count number of rows in the band
+ */
+void Camera::chooseRows(Frame& frame, size_t y, size_t count) {
+
+    size_t ymax = std::min(y + count, frame.height);
+    glm::vec3* hdr = frame.hdr;
+
+    for (size_t i = y; i < ymax; i++) {
+        for (size_t j = 0; j < frame.width; j++) {
+
+            size_t p = getIndex(frame, i, j);
+            float l = getLuminance(hdr[p]);
+            bool noisy = baseSamples > 1 && getError(l * baseSamples, frame.squares[p], baseSamples) > threshold;
+
+            // contrast with any of the four neighbours marks an edge
+            float right = (j + 1 < frame.width) ? getLuminance(hdr[p + 1]) : l;
+            float below = (i + 1 < frame.height) ? getLuminance(hdr[getIndex(frame, i + 1, j)]) : l;
+            float left = (j > 0) ? getLuminance(hdr[p - 1]) : l;
+            float above = (i > 0) ? getLuminance(hdr[getIndex(frame, i - 1, j)]) : l;
+
+            bool edge = false;
+            for (float n : { right, below, left, above }) {
+                edge |= glm::abs(l - n) > threshold * std::max(l + n, EPSILON);
+            }
+
+            frame.refine[p] = noisy || edge;
+
+        }
+    }
+
+}
+
+/**
+ * Double the samples of each chosen pixel of a tile until it settles.
+ * @param frame frame being rendered
+ * @param x first column of the tile
+ * @param y first row of the tile
+ * @param local scratch state of the calling thread
+ */
+void Camera::refineTile(Frame& frame, size_t x, size_t y, TileScratch& local) {
+
+    size_t ymax = std::min(y + TILE_SIZE, frame.height);
+    size_t xmax = std::min(x + TILE_SIZE, frame.width);
+
+    for (size_t i = y; i < ymax; i++) {
+        for (size_t j = x; j < xmax; j++) {
+
+            size_t p = getIndex(frame, i, j);
+            if (!frame.refine[p]) {
+                continue;
+            }
+
+            size_t n = baseSamples;
+            glm::vec3 sum = frame.hdr[p] * float(n);
+            float luminance = getLuminance(sum);
+            float square = frame.squares[p];
+
+            do {
+
+                size_t target = std::min(2 * n, maxSamples);
+                for (size_t k = n; k < target; k++) {
+                    glm::vec3 color = getSample(*frame.scene, position, frame.film, i, j, k);
+                    float l = getLuminance(color);
+                    sum += color;
+                    luminance += l;
+                    square += l * l;
+                }
+
+                local.samples += target - n;
+                n = target;
+
+            } while (n < maxSamples && getError(luminance, square, n) > threshold);
+
+            frame.hdr[p] = sum / float(n);
+            local.refined++;
+
+        }
+    }
+
+}
+
+/**
+ * Print load balance, sampling and mailboxing statistics of a render.
+ * @param scratch per-thread scratch state
+ * @param threads render thread count
+ * @param pixels pixels rendered
+ * @param tested primitive tests counted before the render
+ * @param skipped primitive tests skipped before the render
+ */
+void Camera::report(vector<TileScratch>& scratch, size_t threads, size_t pixels, size_t tested, size_t skipped) {
+
+    // report load balance
+    size_t busiest = 0;
+    for (auto it = scratch.begin(); it != scratch.end(); it++) {
+        busiest = std::max(busiest, it->tiles);
+    }
+    std::cout << "rendered on " << threads << " threads (at most " << busiest << " tiles per thread)." << std::endl;
+
+    // report sampling
+    if (baseSamples > 1 || maxSamples > baseSamples) {
+        size_t samples = 0;
+        size_t refined = 0;
+        for (auto it = scratch.begin(); it != scratch.end(); it++) {
+            samples += it->samples;
+            refined += it->refined;
+        }
+        std::cout << "  " << double(samples) / pixels << " samples per pixel, "
+                  << refined << " of " << pixels << " pixels refined." << std::endl;
+    }
+
+    // report primitive tests avoided by k-d tree mailboxing
+    size_t totalTested, totalSkipped;
+    Mailbox::getCounts(totalTested, totalSkipped);
+    tested = totalTested - tested;
+    skipped = totalSkipped - skipped;
+    if (tested + skipped > 0) {
+        std::cout << "  mailboxing skipped " << skipped << " of " << tested + skipped << " primitive tests ("
+                  << 100.0 * skipped / (tested + skipped) << "%)." << std::endl;
+    }
+
+}
+
+/**
+ * Render a whole frame of radiance, before tone reproduction.
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @param scene scene to render
+ * @param pool threads to render on
+ * @return radiance of every pixel, owned by the caller
+ */
+glm::vec3* Camera::renderHDR(size_t height, size_t width, Scene& scene, ThreadPool& pool) {
+
+    TaskGroup group(pool);
+
     std::cout << "rendering..." << std::endl;
 
-    glm::vec3 dir;
-    for (size_t i = 0; i < height; i++) {
-        for (size_t j = 0; j < width; j++) {
-            dir = glm::normalize(glm::vec3(ul + dw * float(j) + dh * float(i)));
-            hdr[i*width + j] = scene.getPixel(position, dir, 1);
+    // summed squared sample luminance and refine flags, kept only when pixels may be refined
+    bool adaptive = maxSamples > baseSamples;
+    vector<float> squares(adaptive ? height * width : 0);
+    vector<uint8_t> refine(adaptive ? height * width : 0);
+
+    // create framebuffer
+    Frame frame = { &scene, getFilm(height, width), height, width, height, new glm::vec3[height * width], squares.data(), refine.data() };
+
+    vector<TileScratch> scratch(pool.size() + 1);
+
+    size_t tested, skipped;
+    Mailbox::getCounts(tested, skipped);
+
+    for (size_t y = 0; y < height; y += TILE_SIZE) {
+        for (size_t x = 0; x < width; x += TILE_SIZE) {
+            group.run([&, x, y] {
+                traceTile(frame, x, y, scratch[pool.index()]);
+            });
         }
     }
 
-    // tone reproduction
-    if (tone == nullptr) {
-        tone = new LinearModel();
+    group.wait();
+
+    if (adaptive) {
+
+        // choose pixels to refine before any change, as tiles read their neighbours
+        for (size_t y = 0; y < height; y += TILE_SIZE) {
+            group.run([&, y] {
+                chooseRows(frame, y, TILE_SIZE);
+            });
+        }
+
+        group.wait();
+
+        for (size_t y = 0; y < height; y += TILE_SIZE) {
+            for (size_t x = 0; x < width; x += TILE_SIZE) {
+                group.run([&, x, y] {
+                    refineTile(frame, x, y, scratch[pool.index()]);
+                });
+            }
+        }
+
+        group.wait();
+
+    }
+
+    report(scratch, pool.size(), height * width, tested, skipped);
+
+    return frame.hdr;
+
+}
+
+/**
+ * Render a scene whose tree has already been generated.
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @param scene scene to render
+ * @param pool threads to render on
+ */
+glm::vec3* Camera::render(size_t height, size_t width, Scene& scene, ThreadPool& pool) {
+
+    glm::vec3* hdr = renderHDR(height, width, scene, pool);
+
+    // tone reproduction, in place
+    tone->apply(hdr, height, width, &pool);
+    return hdr;
+
+}
+
+/**
+ * Render a scene whose tree has already been generated straight to an
+ * image, for frames too large to hold in memory. Bands of TILE_SIZE rows
+ * are traced, refined, tone mapped and written in order while only a
+ * window of STREAM_BANDS bands is held, and each band is written while a
+ * later one is traced. The tone operator is fit beforehand to a preview
+ * at 1/STREAM_PREVIEW of the resolution, since the frame is never whole.
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @param scene scene to render
+ * @param pool threads to render on
+ * @param writer writer opened for an image of this size
+ */
+void Camera::render(size_t height, size_t width, Scene& scene, ThreadPool& pool, ImageWriter& writer) {
+
+    TaskGroup group(pool);
+
+    // fit tone reproduction to a preview
+    size_t previewHeight = std::max(height / STREAM_PREVIEW, (size_t) 1);
+    size_t previewWidth = std::max(width / STREAM_PREVIEW, (size_t) 1);
+    std::cout << "fitting tone reproduction to a " << previewWidth << "x" << previewHeight << " preview..." << std::endl;
+    glm::vec3* preview = renderHDR(previewHeight, previewWidth, scene, pool);
+    tone->fit(preview, previewHeight * previewWidth, &pool);
+    delete[] preview;
+
+    std::cout << "rendering..." << std::endl;
+
+    // window of bands, each kept until it is written
+    size_t rows = STREAM_BANDS * TILE_SIZE;
+    bool adaptive = maxSamples > baseSamples;
+    vector<glm::vec3> hdr(rows * width);
+    vector<float> squares(adaptive ? rows * width : 0);
+    vector<uint8_t> refine(adaptive ? rows * width : 0);
+    Frame frame = { &scene, getFilm(height, width), height, width, rows, hdr.data(), squares.data(), refine.data() };
+
+    // 8-bit formats take codes straight from tone reproduction
+    ByteWriter* bytes = dynamic_cast<ByteWriter*>(&writer);
+    vector<uint8_t> codes(bytes != nullptr ? 3 * TILE_SIZE * width : 0);
+
+    vector<TileScratch> scratch(pool.size() + 1);
+
+    size_t tested, skipped;
+    Mailbox::getCounts(tested, skipped);
+
+    // band b is traced, then chosen once band b + 1 is traced, refined once
+    // band b + 1 is chosen, and written while band b + 3 is traced
+    size_t bands = (height + TILE_SIZE - 1) / TILE_SIZE;
+    for (size_t b = 0; b < bands + 3; b++) {
+
+        if (b < bands) {
+            for (size_t x = 0; x < width; x += TILE_SIZE) {
+                group.run([&, x, b] {
+                    traceTile(frame, x, b * TILE_SIZE, scratch[pool.index()]);
+                });
+            }
+        }
+
+        if (b >= 3) {
+            size_t y = (b - 3) * TILE_SIZE;
+            size_t count = std::min(y + TILE_SIZE, height) - y;
+            glm::vec3* band = frame.hdr + getIndex(frame, y, 0);
+            if (bytes != nullptr) {
+                tone->map(band, codes.data(), count * width, bytes->getQuantizer());
+                bytes->write(codes.data(), y, count);
+            } else {
+                tone->map(band, band, count * width);
+                writer.write(band, y, count);
+            }
+        }
+
+        group.wait();
+
+        if (adaptive && b >= 1 && b - 1 < bands) {
+            size_t y = (b - 1) * TILE_SIZE;
+            for (size_t i = y; i < std::min(y + TILE_SIZE, height); i++) {
+                group.run([&, i] {
+                    chooseRows(frame, i, 1);
+                });
+            }
+            group.wait();
+        }
+
+        if (adaptive && b >= 2 && b - 2 < bands) {
+            for (size_t x = 0; x < width; x += TILE_SIZE) {
+                group.run([&, x, b] {
+                    refineTile(frame, x, (b - 2) * TILE_SIZE, scratch[pool.index()]);
+                });
+            }
+            group.wait();
+        }
+
     }
 
-    glm::vec3* out = tone->apply(hdr, height, width);
-    delete[] hdr;
-    return out;
+    report(scratch, pool.size(), height * width, tested, skipped);
 
 }
\ No newline at end of file
@@ -1,21 +1,52 @@
+#include <vector>
 #include <glm/vec3.hpp>
 #include <glm/mat4x4.hpp>
 
 #include "tone.h"
 
+// width and height of a render tile in pixels
+#define TILE_SIZE 16
+
+// bands of TILE_SIZE rows held while streaming a frame to an image
+#define STREAM_BANDS 4
+
+// downscale of the preview a streamed frame's tone reproduction is fit to
+#define STREAM_PREVIEW 8
+
 class Scene;
+class ThreadPool;
+class ImageWriter;
+struct Film;
+struct Frame;
+struct TileScratch;
 
 class Camera {
 
     private:
         glm::vec3 position;
-        glm::mat4 m;
+        glm::mat4 toWorld;
         float fov;
         float length;
         ToneOperator* tone = nullptr;
+        size_t threads = 0;
+        size_t packet = 16;
+        size_t baseSamples = 1;
+        size_t maxSamples = 1;
+        float threshold = 0.05f;
+        Film getFilm(size_t height, size_t width);
+        void traceTile(Frame& frame, size_t x, size_t y, TileScratch& local);
+        void chooseRows(Frame& frame, size_t y, size_t count);
+        void refineTile(Frame& frame, size_t x, size_t y, TileScratch& local);
+        void report(std::vector<TileScratch>& scratch, size_t threads, size_t pixels, size_t tested, size_t skipped);
+        glm::vec3* renderHDR(size_t height, size_t width, Scene& scene, ThreadPool& pool);
 
     public:
         Camera(glm::vec3 position, glm::vec3 eye, glm::vec3 up, ToneOperator* tone = nullptr);
-        glm::vec3* render(size_t height, size_t width, Scene Scene);
+        void setThreads(size_t threads);
+        void setPacketSize(size_t size);
+        void setSampling(size_t base, size_t max, float threshold);
+        glm::vec3* render(size_t height, size_t width, Scene& scene);
+        glm::vec3* render(size_t height, size_t width, Scene& scene, ThreadPool& pool);
+        void render(size_t height, size_t width, Scene& scene, ThreadPool& pool, ImageWriter& writer);
 
 };
\ No newline at end of file
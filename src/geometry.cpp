@@ -0,0 +1,568 @@
+#include <algorithm>
+#include <cmath>
+#include <glm/geometric.hpp>
+
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "geometry.h"
+#include "object.h"
+#include "instance.h"
+#include "cache.h"
+
+/**
+ * @return storage type of a primitive
+ */
+PrimitiveType Geometry::getType(Primitive* prim) {
+    if (dynamic_cast<Triangle*>(prim) != nullptr) {
+        return TYPE_TRIANGLE;
+    } else if (dynamic_cast<Sphere*>(prim) != nullptr) {
+        return TYPE_SPHERE;
+    } else if (dynamic_cast<Instance*>(prim) != nullptr) {
+        return TYPE_INSTANCE;
+    } else {
+        return TYPE_OTHER;
+    }
+}
+
+/**
+ * @return storage type of a built primitive
+ */
+PrimitiveType Geometry::getType(uint32_t index) {
+    return (PrimitiveType) types[index];
+}
+
+/**
+ * Sort a range of a primitive list by type, keeping the order within each
+ * type.
+ * @param prims list to sort in place
+ * @param first index of first primitive in range
+ * @param count number of primitives in range
+ */
+void Geometry::sort(vector<Primitive*>& prims, uint32_t first, uint32_t count) {
+    std::stable_sort(prims.begin() + first, prims.begin() + first + count, [](Primitive* a, Primitive* b) {
+        return getType(a) < getType(b);
+    });
+}
+
+/**
+ * Copy the geometry of every primitive in a list into per-type arrays. The
+ * list must outlive this structure and keep its order, as ranges, indices
+ * and hits refer to it.
+ * @param prims primitives, in the order leaves will reference them
+ */
+void Geometry::build(vector<Primitive*>* prims) {
+
+    list = prims;
+    size_t n = prims->size();
+
+    types.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        types[i] = getType((*prims)[i]);
+    }
+    countTypes();
+
+    // pad triangles so the last block can be loaded whole
+    for (int f = 0; f < FIELDS; f++) {
+        triangles[f].assign(before[TYPE_TRIANGLE][n] + TRI_WIDTH, 0.0f);
+    }
+    spheres.resize(before[TYPE_SPHERE][n]);
+    instances.resize(before[TYPE_INSTANCE][n]);
+    others.resize(before[TYPE_OTHER][n]);
+
+    for (size_t i = 0; i < n; i++) {
+
+        uint32_t rank = before[types[i]][i];
+
+        if (types[i] == TYPE_TRIANGLE) {
+
+            Triangle* tri = static_cast<Triangle*>((*prims)[i]);
+            glm::vec3 a = tri->getVertex(0);
+            glm::vec3 e1 = tri->getVertex(1) - a;
+            glm::vec3 e2 = tri->getVertex(2) - a;
+
+            for (int k = 0; k < 3; k++) {
+                triangles[AX + k][rank] = a[k];
+                triangles[E1X + k][rank] = e1[k];
+                triangles[E2X + k][rank] = e2[k];
+            }
+
+        } else if (types[i] == TYPE_SPHERE) {
+            Sphere* sphere = static_cast<Sphere*>((*prims)[i]);
+            spheres[rank] = glm::vec4(sphere->getPosition(), sphere->getRadius());
+        } else if (types[i] == TYPE_INSTANCE) {
+            instances[rank] = static_cast<Instance*>((*prims)[i]);
+        } else {
+            others[rank] = (*prims)[i];
+        }
+
+    }
+
+}
+
+/**
+ * Count the primitives of each type before every position of the list.
+ */
+void Geometry::countTypes() {
+
+    size_t n = types.size();
+
+    for (int t = 0; t < TYPE_COUNT; t++) {
+        before[t].assign(n + 1, 0);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        for (int t = 0; t < TYPE_COUNT; t++) {
+            before[t][i + 1] = before[t][i] + (types[i] == t);
+        }
+    }
+
+}
+
+/**
+ * Write the per-type arrays to a cache file. Pointers to instances and other
+ * primitives are not stored, as they are found again from the list, and
+ * neither are the type counts, which follow from the types.
+ * @param out cache file to append to
+ */
+void Geometry::save(CacheWriter& out) {
+    out.writeArray(types);
+    for (int f = 0; f < FIELDS; f++) {
+        out.writeArray(triangles[f]);
+    }
+    out.writeArray(spheres);
+}
+
+/**
+ * Restore arrays written by save instead of gathering them from the
+ * primitives again. Stored types must match the primitives', since they
+ * decide how each primitive is cast.
+ * @param in cache file positioned at the arrays
+ * @param prims primitives equal to those the arrays were built from, in the
+ *        same order
+ * @return false if the file is invalid
+ */
+bool Geometry::load(CacheReader& in, vector<Primitive*>* prims) {
+
+    list = prims;
+    size_t n = prims->size();
+
+    if (!in.readArray(types) || types.size() != n) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (types[i] != getType((*prims)[i])) {
+            return false;
+        }
+    }
+    countTypes();
+
+    for (int f = 0; f < FIELDS; f++) {
+        if (!in.readArray(triangles[f]) || triangles[f].size() != before[TYPE_TRIANGLE][n] + TRI_WIDTH) {
+            return false;
+        }
+    }
+    if (!in.readArray(spheres) || spheres.size() != before[TYPE_SPHERE][n]) {
+        return false;
+    }
+
+    instances.resize(before[TYPE_INSTANCE][n]);
+    others.resize(before[TYPE_OTHER][n]);
+
+    for (size_t i = 0; i < n; i++) {
+        if (types[i] == TYPE_INSTANCE) {
+            instances[before[TYPE_INSTANCE][i]] = static_cast<Instance*>((*prims)[i]);
+        } else if (types[i] == TYPE_OTHER) {
+            others[before[TYPE_OTHER][i]] = (*prims)[i];
+        }
+    }
+
+    return true;
+
+}
+
+/**
+ * @param first index of first primitive in range
+ * @param count number of primitives in range, which must lie in the list
+ * @return true if the range is sorted by type, as leaf ranges must be
+ */
+bool Geometry::isSorted(uint32_t first, uint32_t count) {
+    for (uint32_t i = first + 1; i < first + count; i++) {
+        if (types[i] < types[i - 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @return memory used by the arrays
+ */
+size_t Geometry::getBytes() {
+    return FIELDS * triangles[0].size() * sizeof(float) + spheres.size() * sizeof(glm::vec4)
+         + (instances.size() + others.size()) * sizeof(Primitive*) + types.size() + TYPE_COUNT * before[0].size() * sizeof(uint32_t);
+}
+
+/**
+ * Find the nearest hit among a range of primitives sorted by type.
+ * @param ray ray to trace
+ * @param first index of first primitive in range
+ * @param count number of primitives in range
+ * @param min distance to nearest hit so far, updated in place
+ * @param hit nearest hit so far, updated in place
+ * @return true if a nearer hit was found
+ */
+bool Geometry::intersect(const Ray& ray, uint32_t first, uint32_t count, float& min, Hit& hit) {
+
+    uint32_t end = first + count;
+    uint32_t start = first;
+    bool found = false;
+
+    for (int t = 0; t < TYPE_COUNT; t++) {
+
+        // ranks of this type within the range
+        uint32_t a = before[t][first];
+        uint32_t b = before[t][end];
+
+        if (a == b) {
+            continue;
+        }
+
+        int rank = -1;
+
+        if (t == TYPE_TRIANGLE) {
+            intersectTriangles(ray, a, b, min, rank);
+        } else if (t == TYPE_SPHERE) {
+            intersectSpheres(ray, a, b, min, rank);
+        } else if (t == TYPE_INSTANCE) {
+            for (uint32_t i = a; i < b; i++) {
+                found |= instances[i]->intersect(ray, min, hit);
+            }
+        } else {
+            float dist;
+            for (uint32_t i = a; i < b; i++) {
+                if ((dist = others[i]->intersect(ray.origin, ray.direction)) < min && dist > 0) {
+                    min = dist;
+                    rank = i;
+                }
+            }
+        }
+
+        if (rank >= 0) {
+            hit.object = (*list)[start + (rank - a)];
+            hit.instance = nullptr;
+            found = true;
+        }
+
+        start += b - a;
+
+    }
+
+    return found;
+
+}
+
+/**
+ * Intersect a ray with a single primitive.
+ * @param ray ray to trace
+ * @param index index of primitive
+ * @param min distance to nearest hit so far, updated in place
+ * @param hit nearest hit so far, updated in place
+ * @return true if the primitive is hit nearer than min
+ */
+bool Geometry::intersect(const Ray& ray, uint32_t index, float& min, Hit& hit) {
+
+    uint32_t rank = before[types[index]][index];
+    float dist;
+
+    switch (types[index]) {
+        case TYPE_TRIANGLE:
+            dist = intersectTriangle(ray, rank);
+            break;
+        case TYPE_SPHERE:
+            dist = intersectSphere(ray, rank);
+            break;
+        case TYPE_INSTANCE:
+            return instances[rank]->intersect(ray, min, hit);
+        default:
+            dist = others[rank]->intersect(ray.origin, ray.direction);
+            break;
+    }
+
+    if (dist < min && dist > 0) {
+        min = dist;
+        hit.object = (*list)[index];
+        hit.instance = nullptr;
+        return true;
+    }
+
+    return false;
+
+}
+
+/**
+ * Test whether any primitive in a range sorted by type lies along a ray
+ * segment.
+ * @param ray ray to trace
+ * @param first index of first primitive in range
+ * @param count number of primitives in range
+ * @param tmax length of the segment
+ * @return true if some primitive is hit within (0, tmax)
+ */
+bool Geometry::occluded(const Ray& ray, uint32_t first, uint32_t count, float tmax) {
+
+    uint32_t end = first + count;
+    float min = tmax;
+    int rank = -1;
+
+    intersectTriangles(ray, before[TYPE_TRIANGLE][first], before[TYPE_TRIANGLE][end], min, rank);
+    if (rank >= 0) {
+        return true;
+    }
+
+    intersectSpheres(ray, before[TYPE_SPHERE][first], before[TYPE_SPHERE][end], min, rank);
+    if (rank >= 0) {
+        return true;
+    }
+
+    // instances answer any-hit queries themselves
+    for (uint32_t i = before[TYPE_INSTANCE][first]; i < before[TYPE_INSTANCE][end]; i++) {
+        if (instances[i]->occluded(ray, tmax)) {
+            return true;
+        }
+    }
+
+    float dist;
+    for (uint32_t i = before[TYPE_OTHER][first]; i < before[TYPE_OTHER][end]; i++) {
+        if ((dist = others[i]->intersect(ray.origin, ray.direction)) < tmax && dist > 0) {
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+/**
+ * Test whether a single primitive lies along a ray segment.
+ * @param ray ray to trace
+ * @param index index of primitive
+ * @param tmax length of the segment
+ * @return true if the primitive is hit within (0, tmax)
+ */
+bool Geometry::occluded(const Ray& ray, uint32_t index, float tmax) {
+
+    if (types[index] == TYPE_INSTANCE) {
+        return instances[before[TYPE_INSTANCE][index]]->occluded(ray, tmax);
+    }
+
+    Hit hit;
+    float min = tmax;
+    return intersect(ray, index, min, hit);
+
+}
+
+/**
+ * Möller-Trumbore test of one stored triangle, as in Triangle::intersect.
+ * @return distance to intersection, or infinity if missed
+ */
+float Geometry::intersectTriangle(const Ray& ray, uint32_t i) {
+
+    glm::vec3 a = glm::vec3(triangles[AX][i], triangles[AY][i], triangles[AZ][i]);
+    glm::vec3 e1 = glm::vec3(triangles[E1X][i], triangles[E1Y][i], triangles[E1Z][i]);
+    glm::vec3 e2 = glm::vec3(triangles[E2X][i], triangles[E2Y][i], triangles[E2Z][i]);
+    glm::vec3 t = ray.origin - a;
+    glm::vec3 p = glm::cross(ray.direction, e2);
+    glm::vec3 q = glm::cross(t, e1);
+    float det = glm::dot(p, e1);
+
+    // parallel
+    if (!(std::abs(det) >= EPSILON)) {
+        return INFINITY;
+    }
+
+    float dist = glm::dot(q, e2) / det;
+    float u = glm::dot(p, t) / det;
+    float v = glm::dot(q, ray.direction) / det;
+
+    return (dist >= 0 && u >= 0 && v >= 0 && u + v < 1) ? dist : INFINITY;
+
+}
+
+/**
+ * Test of one stored sphere, as in Sphere::intersect.
+ * @return distance to nearest intersection beyond EPSILON, or infinity
+ */
+float Geometry::intersectSphere(const Ray& ray, uint32_t i) {
+
+    glm::vec3 dist = ray.origin - glm::vec3(spheres[i]);
+    float radius = spheres[i].w;
+
+    // a is always 1 for normalized vectors
+    float b = 2 * glm::dot(ray.direction, dist);
+    float c = glm::dot(dist, dist) - radius * radius;
+    float discriminant = b * b - 4 * c;
+
+    if (discriminant < 0) {
+        return INFINITY;
+    }
+
+    float first = (-b - std::sqrt(discriminant)) / 2;
+    float second = (-b + std::sqrt(discriminant)) / 2;
+    return (first > EPSILON) ? first : (second > EPSILON) ? second : INFINITY;
+
+}
+
+/**
+ * Find the nearest hit among a run of stored spheres.
+ * @param first rank of first sphere
+ * @param end rank past last sphere
+ * @param min distance to nearest hit so far, updated in place
+ * @param index rank of nearest sphere hit, updated in place
+ */
+void Geometry::intersectSpheres(const Ray& ray, uint32_t first, uint32_t end, float& min, int& index) {
+    float dist;
+    for (uint32_t i = first; i < end; i++) {
+        if ((dist = intersectSphere(ray, i)) < min && dist > 0) {
+            min = dist;
+            index = i;
+        }
+    }
+}
+
+/**
+ * Find the nearest hit among a run of stored triangles, TRI_WIDTH at a time.
+ * @param ray ray to trace
+ * @param first rank of first triangle
+ * @param end rank past last triangle
+ * @param min distance to nearest hit so far, updated in place
+ * @param index rank of nearest triangle hit, updated in place
+ */
+void Geometry::intersectTriangles(const Ray& ray, uint32_t first, uint32_t end, float& min, int& index) {
+
+#if TRI_WIDTH == 8
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 eps = _mm256_set1_ps(EPSILON);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+
+    for (uint32_t i = first; i < end; i += 8) {
+
+        __m256 e1x = _mm256_loadu_ps(&triangles[E1X][i]), e1y = _mm256_loadu_ps(&triangles[E1Y][i]), e1z = _mm256_loadu_ps(&triangles[E1Z][i]);
+        __m256 e2x = _mm256_loadu_ps(&triangles[E2X][i]), e2y = _mm256_loadu_ps(&triangles[E2Y][i]), e2z = _mm256_loadu_ps(&triangles[E2Z][i]);
+        __m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(&triangles[AX][i]));
+        __m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(&triangles[AY][i]));
+        __m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(&triangles[AZ][i]));
+
+        // p = d x e2, q = t x e1
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(e1z, tx));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(e1x, ty));
+
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, e1x), _mm256_mul_ps(py, e1y)), _mm256_mul_ps(pz, e1z));
+        __m256 dist = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, e2x), _mm256_mul_ps(qy, e2y)), _mm256_mul_ps(qz, e2z)), det);
+        __m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, tx), _mm256_mul_ps(py, ty)), _mm256_mul_ps(pz, tz)), det);
+        __m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, dx), _mm256_mul_ps(qy, dy)), _mm256_mul_ps(qz, dz)), det);
+
+        // not parallel, inside triangle, in front of origin and nearer than min
+        __m256 mask = _mm256_cmp_ps(_mm256_andnot_ps(sign, det), eps, _CMP_GE_OQ);
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(dist, zero, _CMP_GT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(dist, _mm256_set1_ps(min), _CMP_LT_OQ));
+
+        int bits = _mm256_movemask_ps(mask);
+        if (end - i < 8) {
+            bits &= (1 << (end - i)) - 1;
+        }
+
+        if (bits) {
+            alignas(32) float t[8];
+            _mm256_store_ps(t, dist);
+            for (int k = 0; k < 8; k++) {
+                if ((bits & (1 << k)) && t[k] < min) {
+                    min = t[k];
+                    index = i + k;
+                }
+            }
+        }
+
+    }
+
+#elif TRI_WIDTH == 4
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 eps = _mm_set1_ps(EPSILON);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+
+    for (uint32_t i = first; i < end; i += 4) {
+
+        __m128 e1x = _mm_loadu_ps(&triangles[E1X][i]), e1y = _mm_loadu_ps(&triangles[E1Y][i]), e1z = _mm_loadu_ps(&triangles[E1Z][i]);
+        __m128 e2x = _mm_loadu_ps(&triangles[E2X][i]), e2y = _mm_loadu_ps(&triangles[E2Y][i]), e2z = _mm_loadu_ps(&triangles[E2Z][i]);
+        __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(&triangles[AX][i]));
+        __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(&triangles[AY][i]));
+        __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(&triangles[AZ][i]));
+
+        // p = d x e2, q = t x e1
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(e1z, tx));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(e1x, ty));
+
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, e1x), _mm_mul_ps(py, e1y)), _mm_mul_ps(pz, e1z));
+        __m128 dist = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, e2x), _mm_mul_ps(qy, e2y)), _mm_mul_ps(qz, e2z)), det);
+        __m128 u = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, tx), _mm_mul_ps(py, ty)), _mm_mul_ps(pz, tz)), det);
+        __m128 v = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, dx), _mm_mul_ps(qy, dy)), _mm_mul_ps(qz, dz)), det);
+
+        // not parallel, inside triangle, in front of origin and nearer than min
+        __m128 mask = _mm_cmpge_ps(_mm_andnot_ps(sign, det), eps);
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(_mm_add_ps(u, v), one));
+        mask = _mm_and_ps(mask, _mm_cmpgt_ps(dist, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(dist, _mm_set1_ps(min)));
+
+        int bits = _mm_movemask_ps(mask);
+        if (end - i < 4) {
+            bits &= (1 << (end - i)) - 1;
+        }
+
+        if (bits) {
+            alignas(16) float t[4];
+            _mm_store_ps(t, dist);
+            for (int k = 0; k < 4; k++) {
+                if ((bits & (1 << k)) && t[k] < min) {
+                    min = t[k];
+                    index = i + k;
+                }
+            }
+        }
+
+    }
+
+#else
+
+    float dist;
+    for (uint32_t i = first; i < end; i++) {
+        if ((dist = intersectTriangle(ray, i)) < min && dist > 0) {
+            min = dist;
+            index = i;
+        }
+    }
+
+#endif
+
+}
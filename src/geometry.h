@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/vec4.hpp>
+
+#include "scene.h"
+
+class Primitive;
+class Instance;
+class CacheWriter;
+class CacheReader;
+
+using std::vector;
+
+// triangles intersected per SIMD instruction
+#if defined(__AVX__)
+#define TRI_WIDTH 8
+#elif defined(__SSE__)
+#define TRI_WIDTH 4
+#else
+#define TRI_WIDTH 1
+#endif
+
+/**
+ * Primitive types with their own storage, in the order they are sorted.
+ */
+enum PrimitiveType {
+    TYPE_TRIANGLE,
+    TYPE_SPHERE,
+    TYPE_INSTANCE,  // traced through the instanced mesh's own structure
+    TYPE_OTHER,     // tested through the virtual call
+    TYPE_COUNT
+};
+
+/**
+ * Geometry of a primitive list copied into homogeneous per-type arrays:
+ * triangle corners and edges as structure of arrays for the SIMD
+ * Möller-Trumbore kernel, sphere centers and radii, and instances. Ranges of the list
+ * whose primitives are sorted by type are intersected one type at a time,
+ * so each range costs one dispatch rather than a virtual call per primitive.
+ */
+class Geometry {
+
+    private:
+        enum { AX, AY, AZ, E1X, E1Y, E1Z, E2X, E2Y, E2Z, FIELDS };
+        vector<float> triangles[FIELDS];
+        vector<glm::vec4> spheres;
+        vector<Instance*> instances;
+        vector<Primitive*> others;
+        vector<Primitive*>* list = nullptr;
+        vector<uint8_t> types;
+        vector<uint32_t> before[TYPE_COUNT];
+        void intersectTriangles(const Ray& ray, uint32_t first, uint32_t end, float& min, int& index);
+        void intersectSpheres(const Ray& ray, uint32_t first, uint32_t end, float& min, int& index);
+        float intersectTriangle(const Ray& ray, uint32_t i);
+        float intersectSphere(const Ray& ray, uint32_t i);
+        void countTypes();
+
+    public:
+        static PrimitiveType getType(Primitive* prim);
+        PrimitiveType getType(uint32_t index);
+        static void sort(vector<Primitive*>& prims, uint32_t first, uint32_t count);
+        void build(vector<Primitive*>* prims);
+        void save(CacheWriter& out);
+        bool load(CacheReader& in, vector<Primitive*>* prims);
+        bool isSorted(uint32_t first, uint32_t count);
+        size_t getBytes();
+        bool intersect(const Ray& ray, uint32_t first, uint32_t count, float& min, Hit& hit);
+        bool intersect(const Ray& ray, uint32_t index, float& min, Hit& hit);
+        bool occluded(const Ray& ray, uint32_t first, uint32_t count, float tmax);
+        bool occluded(const Ray& ray, uint32_t index, float tmax);
+
+};
@@ -0,0 +1,427 @@
+#include <cmath>
+#include <cstring>
+#include <glm/common.hpp>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "image.h"
+#include "tone.h"
+
+// QOI chunk tags
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+
+// longest run a single QOI chunk can hold
+#define QOI_MAX_RUN 62
+
+/**
+ * Build the table of values at which each code starts.
+ * @param gamma display gamma, 1 for linear output
+ */
+Quantizer::Quantizer(float gamma) {
+    this->gamma = gamma;
+    for (int k = 0; k < 256; k++) {
+        starts[k] = MAX_DISP_LUM * std::pow(k / 255.0f, gamma);
+    }
+}
+
+float Quantizer::getGamma() {
+    return gamma;
+}
+
+/**
+ * @param value tone mapped channel value
+ * @return 8-bit code
+ */
+uint8_t Quantizer::quantize(float value) {
+
+    if (gamma == 1.0f) {
+        return (uint8_t) glm::floor(255.0f * glm::clamp(value / MAX_DISP_LUM, 0.0f, 1.0f));
+    }
+
+    // largest code starting at or below the value, in eight branchless steps
+    int code = 0;
+    for (int step = 128; step > 0; step >>= 1) {
+        code += (value >= starts[code + step]) ? step : 0;
+    }
+
+    return code;
+
+}
+
+/**
+ * Quantize an array of values.
+ * @param values tone mapped channel values
+ * @param codes output 8-bit codes
+ * @param count number of values
+ */
+void Quantizer::quantize(const float* values, uint8_t* codes, size_t count) {
+
+    size_t i = 0;
+
+#ifdef __SSE2__
+    if (gamma == 1.0f) {
+
+        // the scalar steps sixteen at a time; values are clamped non-negative, so truncation floors
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        __m128i lanes[4];
+
+        for (; i + 16 <= count; i += 16) {
+            for (int k = 0; k < 4; k++) {
+                __m128 v = _mm_div_ps(_mm_loadu_ps(values + i + 4 * k), _mm_set1_ps(MAX_DISP_LUM));
+                v = _mm_min_ps(_mm_max_ps(v, zero), one);
+                lanes[k] = _mm_cvttps_epi32(_mm_mul_ps(_mm_set1_ps(255.0f), v));
+            }
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(lanes[0], lanes[1]), _mm_packs_epi32(lanes[2], lanes[3]));
+            _mm_storeu_si128((__m128i*) (codes + i), packed);
+        }
+
+    }
+#endif
+
+    for (; i < count; i++) {
+        codes[i] = quantize(values[i]);
+    }
+
+}
+
+// WRITER
+
+/**
+ * Create a file and write its header.
+ * @param filename file to write
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @return false if the file could not be created
+ */
+bool ImageWriter::open(std::string filename, size_t height, size_t width) {
+
+    file.open(filename, std::ios::binary | std::ios::trunc);
+    this->height = height;
+    this->width = width;
+    next = 0;
+    buffer.reserve(IMAGE_BUFFER_SIZE);
+
+    if (!file) {
+        return false;
+    }
+
+    writeHeader();
+    return file.good();
+
+}
+
+/**
+ * Check that rows follow the last ones written, failing the file if not.
+ * @param first index of the first row
+ * @param count number of rows
+ * @return false if the rows are out of sequence or past the last row
+ */
+bool ImageWriter::advance(size_t first, size_t count) {
+
+    if (first != next || count > height - first) {
+        file.setstate(std::ios::failbit);
+        return false;
+    }
+
+    next += count;
+    return true;
+
+}
+
+/**
+ * Append bytes to the output buffer, writing it out when full.
+ * @param data bytes to write
+ * @param bytes number of bytes
+ */
+void ImageWriter::put(const char* data, size_t bytes) {
+
+    if (buffer.size() + bytes > IMAGE_BUFFER_SIZE) {
+        flush();
+    }
+
+    if (bytes >= IMAGE_BUFFER_SIZE) {
+        file.write(data, bytes);
+    } else {
+        buffer.insert(buffer.end(), data, data + bytes);
+    }
+
+}
+
+/**
+ * Write out the buffered bytes.
+ */
+void ImageWriter::flush() {
+    file.write(buffer.data(), buffer.size());
+    buffer.clear();
+}
+
+/**
+ * Write anything that follows the last row. Formats without a trailer
+ * write nothing.
+ */
+void ImageWriter::finish() {}
+
+/**
+ * Finish and close the file.
+ * @return false if any write failed
+ */
+bool ImageWriter::close() {
+    finish();
+    flush();
+    file.close();
+    return !file.fail();
+}
+
+// 8-BIT
+
+/**
+ * @param gamma display gamma, 1 for linear output
+ */
+ByteWriter::ByteWriter(float gamma) : quantizer(gamma) {}
+
+/**
+ * @return quantizer rows must be coded with
+ */
+Quantizer& ByteWriter::getQuantizer() {
+    return quantizer;
+}
+
+/**
+ * Quantize and write rows of the frame.
+ * @param rows first pixel of the first row
+ * @param first index of the first row
+ * @param count number of rows
+ */
+void ByteWriter::write(glm::vec3* rows, size_t first, size_t count) {
+
+    row.resize(3 * width);
+
+    for (size_t y = 0; y < count; y++) {
+        quantizer.quantize(&rows[y * width].x, row.data(), row.size());
+        write(row.data(), first + y, 1);
+    }
+
+}
+
+// PPM
+
+/**
+ * @param gamma display gamma, 1 for linear output
+ */
+PPMWriter::PPMWriter(float gamma) : ByteWriter(gamma) {}
+
+void PPMWriter::writeHeader() {
+    std::string header = "P6 " + std::to_string(width) + " " + std::to_string(height) + " 255\n";
+    put(header.data(), header.size());
+}
+
+/**
+ * Write quantized rows of the frame.
+ * @param rows codes of the first row
+ * @param first index of the first row
+ * @param count number of rows
+ */
+void PPMWriter::write(const uint8_t* rows, size_t first, size_t count) {
+    if (advance(first, count)) {
+        put((const char*) rows, 3 * width * count);
+    }
+}
+
+// PFM
+
+void PFMWriter::writeHeader() {
+    // a negative scale marks little-endian data
+    std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    put(header.data(), header.size());
+    flush();
+    headerSize = header.size();
+    row.resize(3 * width);
+}
+
+/**
+ * Scale and write rows of the frame, each at its place counted from the
+ * bottom of the file.
+ * @param rows first pixel of the first row
+ * @param first index of the first row
+ * @param count number of rows
+ */
+void PFMWriter::write(glm::vec3* rows, size_t first, size_t count) {
+
+    for (size_t y = 0; y < count; y++) {
+
+        glm::vec3* pixels = rows + y * width;
+        for (size_t x = 0; x < width; x++) {
+            row[3 * x] = pixels[x].x / MAX_DISP_LUM;
+            row[3 * x + 1] = pixels[x].y / MAX_DISP_LUM;
+            row[3 * x + 2] = pixels[x].z / MAX_DISP_LUM;
+        }
+
+        size_t bytes = row.size() * sizeof(float);
+        file.seekp(headerSize + (height - 1 - (first + y)) * bytes);
+        file.write((const char*) row.data(), bytes);
+
+    }
+
+}
+
+// QOI
+
+/**
+ * @param gamma display gamma, 1 for linear output
+ */
+QOIWriter::QOIWriter(float gamma) : ByteWriter(gamma) {}
+
+void QOIWriter::writeHeader() {
+
+    uint8_t header[14] = { 'q', 'o', 'i', 'f' };
+    for (int i = 0; i < 4; i++) {
+        header[4 + i] = (uint8_t) (width >> (24 - 8 * i));
+        header[8 + i] = (uint8_t) (height >> (24 - 8 * i));
+    }
+
+    // three channels, marked linear unless gamma corrected
+    header[12] = 3;
+    header[13] = (quantizer.getGamma() == 1.0f) ? 1 : 0;
+
+    put((const char*) header, sizeof(header));
+    out.reserve(4 * width);
+
+}
+
+/**
+ * Emit the pending run of repeated pixels.
+ */
+void QOIWriter::endRun() {
+    if (run > 0) {
+        out.push_back(QOI_OP_RUN | (run - 1));
+        run = 0;
+    }
+}
+
+/**
+ * Encode quantized rows of the frame.
+ * @param rows codes of the first row
+ * @param first index of the first row
+ * @param count number of rows
+ */
+void QOIWriter::write(const uint8_t* rows, size_t first, size_t count) {
+
+    if (!advance(first, count)) {
+        return;
+    }
+
+    for (size_t y = 0; y < count; y++) {
+
+        const uint8_t* pixels = rows + 3 * y * width;
+        out.clear();
+
+        for (size_t x = 0; x < width; x++) {
+
+            const uint8_t* pixel = pixels + 3 * x;
+
+            if (std::memcmp(pixel, previous, 3) == 0) {
+                if (++run == QOI_MAX_RUN) {
+                    endRun();
+                }
+                continue;
+            }
+
+            endRun();
+
+            // every pixel is opaque, which the hash includes
+            int hash = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + 255 * 11) % 64;
+
+            if (std::memcmp(seen[hash], pixel, 3) == 0 && seen[hash][3] == 255) {
+                out.push_back(QOI_OP_INDEX | hash);
+            } else {
+
+                std::memcpy(seen[hash], pixel, 3);
+                seen[hash][3] = 255;
+
+                int8_t dr = pixel[0] - previous[0];
+                int8_t dg = pixel[1] - previous[1];
+                int8_t db = pixel[2] - previous[2];
+                int8_t drg = dr - dg;
+                int8_t dbg = db - dg;
+
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out.push_back(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                } else if (drg >= -8 && drg <= 7 && dg >= -32 && dg <= 31 && dbg >= -8 && dbg <= 7) {
+                    out.push_back(QOI_OP_LUMA | (dg + 32));
+                    out.push_back((drg + 8) << 4 | (dbg + 8));
+                } else {
+                    out.push_back(QOI_OP_RGB);
+                    out.insert(out.end(), pixel, pixel + 3);
+                }
+
+            }
+
+            std::memcpy(previous, pixel, 3);
+
+        }
+
+        put((const char*) out.data(), out.size());
+
+    }
+
+}
+
+void QOIWriter::finish() {
+    out.clear();
+    endRun();
+    uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    out.insert(out.end(), end, end + 8);
+    put((const char*) out.data(), out.size());
+}
+
+/**
+ * Create a writer for the format named by a file's extension: .pfm, .qoi,
+ * or PPM for anything else.
+ * @param filename file to be written
+ * @param gamma display gamma for 8-bit formats, 1 for linear output
+ * @return new writer, owned by the caller
+ */
+ImageWriter* createImageWriter(std::string filename, float gamma) {
+
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+
+    if (extension == "pfm") {
+        return new PFMWriter();
+    } else if (extension == "qoi") {
+        return new QOIWriter(gamma);
+    } else {
+        return new PPMWriter(gamma);
+    }
+
+}
+
+/**
+ * Write a whole frame to an image file.
+ * @param filename file to write, whose extension picks the format
+ * @param frame tone mapped frame
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @param gamma display gamma for 8-bit formats, 1 for linear output
+ * @return false if the file could not be written
+ */
+bool writeImage(std::string filename, glm::vec3* frame, size_t height, size_t width, float gamma) {
+
+    ImageWriter* writer = createImageWriter(filename, gamma);
+    bool written = writer->open(filename, height, width);
+
+    if (written) {
+        writer->write(frame, 0, height);
+        written = writer->close();
+    }
+
+    delete writer;
+    return written;
+
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <glm/vec3.hpp>
+
+using std::vector;
+
+// bytes collected before each write to disk
+#define IMAGE_BUFFER_SIZE (1 << 16)
+
+/**
+ * Maps tone mapped values in [0, MAX_DISP_LUM] to 8-bit codes with gamma
+ * correction, as floor(255 * (v / MAX_DISP_LUM)^(1 / gamma)). Instead of a
+ * power per channel, the code is found by binary search over the value at
+ * which each code starts.
+ */
+class Quantizer {
+
+    private:
+        float gamma;
+        float starts[256];
+
+    public:
+        Quantizer(float gamma = 1.0f);
+        float getGamma();
+        uint8_t quantize(float value);
+        void quantize(const float* values, uint8_t* codes, size_t count);
+
+};
+
+/**
+ * Writes a frame to an image file, a band of rows at a time, so a frame
+ * can be written as it is finished. Rows must be written top to bottom;
+ * formats that encode them in sequence fail the file, as close reports,
+ * if they are not. Output is collected in a buffer and written to disk in
+ * large blocks.
+ */
+class ImageWriter {
+
+    private:
+        vector<char> buffer;
+        size_t next = 0;
+
+    protected:
+        std::ofstream file;
+        size_t height = 0;
+        size_t width = 0;
+        bool advance(size_t first, size_t count);
+        void put(const char* data, size_t bytes);
+        void flush();
+        virtual void writeHeader() = 0;
+        virtual void finish();
+
+    public:
+        virtual ~ImageWriter() = default;
+        bool open(std::string filename, size_t height, size_t width);
+        virtual void write(glm::vec3* rows, size_t first, size_t count) = 0;
+        bool close();
+
+};
+
+/**
+ * Writer of an 8-bit format. Rows are quantized as they are written, or
+ * may be given already quantized, three codes per pixel, so tone mapping
+ * can write codes directly.
+ */
+class ByteWriter : public ImageWriter {
+
+    private:
+        vector<uint8_t> row;
+
+    protected:
+        Quantizer quantizer;
+
+    public:
+        ByteWriter(float gamma = 1.0f);
+        Quantizer& getQuantizer();
+        virtual void write(glm::vec3* rows, size_t first, size_t count) override;
+        virtual void write(const uint8_t* rows, size_t first, size_t count) = 0;
+
+};
+
+/**
+ * Binary P6 PPM, 8 bits per channel.
+ */
+class PPMWriter : public ByteWriter {
+
+    protected:
+        virtual void writeHeader() override;
+
+    public:
+        PPMWriter(float gamma = 1.0f);
+        using ByteWriter::write;
+        virtual void write(const uint8_t* rows, size_t first, size_t count) override;
+
+};
+
+/**
+ * Little-endian PFM holding linear float values scaled so that
+ * MAX_DISP_LUM is 1, without clamping. PFM stores rows bottom to top, so
+ * each row is placed at its final offset as it is written.
+ */
+class PFMWriter : public ImageWriter {
+
+    private:
+        size_t headerSize = 0;
+        vector<float> row;
+
+    protected:
+        virtual void writeHeader() override;
+
+    public:
+        virtual void write(glm::vec3* rows, size_t first, size_t count) override;
+
+};
+
+/**
+ * Lossless QOI, 8 bits per channel. Pixels are encoded as runs, references
+ * to recently seen colours, or small differences from the previous pixel.
+ */
+class QOIWriter : public ByteWriter {
+
+    private:
+        uint8_t seen[64][4] = {};
+        uint8_t previous[3] = { 0, 0, 0 };
+        int run = 0;
+        vector<uint8_t> out;
+        void endRun();
+
+    protected:
+        virtual void writeHeader() override;
+        virtual void finish() override;
+
+    public:
+        QOIWriter(float gamma = 1.0f);
+        using ByteWriter::write;
+        virtual void write(const uint8_t* rows, size_t first, size_t count) override;
+
+};
+
+ImageWriter* createImageWriter(std::string filename, float gamma = 1.0f);
+bool writeImage(std::string filename, glm::vec3* frame, size_t height, size_t width, float gamma = 1.0f);
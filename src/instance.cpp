@@ -0,0 +1,167 @@
+#include <cstdlib>
+#include <glm/geometric.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/matrix.hpp>
+
+#include "instance.h"
+#include "accel.h"
+
+/**
+ * Place a mesh. The mesh's own transform is applied first, so a mesh made
+ * with the identity placement is positioned by its instances alone. Size
+ * the mesh itself to roughly world scale, since primitive tests run in its
+ * space against fixed tolerances.
+ * @param mesh shared mesh, which should not also be added to the scene
+ * @param position translation
+ * @param rotation euler angles in radians, applied x, y then z
+ * @param scale per-axis scale
+ */
+Instance::Instance(Mesh* mesh, glm::vec3 position, glm::vec3 rotation, glm::vec3 scale) {
+    this->mesh = mesh;
+    this->toWorld = Mesh::getObjectTransform(position, rotation, scale);
+    this->toObject = glm::inverse(toWorld);
+    mesh->getPrimitives();
+    setBounds();
+}
+
+Mesh* Instance::getMesh() {
+    return mesh;
+}
+
+/**
+ * Build the shared mesh's acceleration structure, if no other instance of
+ * it has yet.
+ * @param type backend to build
+ * @param method split plane strategy, for k-d trees
+ * @param pool threads to build on, or null to build serially
+ */
+void Instance::build(AccelType type, SplitMethod method, ThreadPool* pool) {
+    mesh->build(type, method, pool);
+}
+
+/**
+ * Move a ray into the mesh's space. The direction is renormalized so that
+ * primitive tests see the same magnitudes as an uninstanced mesh.
+ * @param ray ray in world space
+ * @param scale output local distance per unit of world distance
+ * @return ray in mesh space
+ */
+Ray Instance::toLocal(const Ray& ray, float& scale) {
+    glm::vec3 direction = glm::mat3(toObject) * ray.direction;
+    scale = glm::length(direction);
+    return Ray(toObject * glm::vec4(ray.origin, 1), direction / scale);
+}
+
+/**
+ * Trace a ray through the shared mesh, bounded by the nearest hit so far so
+ * the mesh's traversal stops early where it can.
+ * @param ray ray in world space
+ * @param min distance to nearest hit so far, updated in place
+ * @param hit nearest hit so far, updated in place with the mesh primitive
+ * @return true if the instance is hit nearer than min
+ */
+bool Instance::intersect(const Ray& ray, float& min, Hit& hit) {
+
+    float scale;
+    Ray local = toLocal(ray, scale);
+    Hit found = mesh->getAccelerator()->intersect(local, min * scale);
+    float dist = found.distance / scale;
+
+    if (found.object != nullptr && dist < min && dist > 0) {
+        min = dist;
+        hit.object = found.object;
+        hit.instance = this;
+        return true;
+    }
+
+    return false;
+
+}
+
+/**
+ * Test whether the shared mesh lies along a ray segment.
+ * @param ray ray in world space
+ * @param tmax length of the segment in world space
+ * @return true if some primitive is hit within (0, tmax)
+ */
+bool Instance::occluded(const Ray& ray, float tmax) {
+    float scale;
+    Ray local = toLocal(ray, scale);
+    return mesh->getAccelerator()->occluded(local, tmax * scale);
+}
+
+/**
+ * @return point in the shared mesh's space
+ */
+glm::vec3 Instance::toObjectSpace(glm::vec3 p) {
+    return toObject * glm::vec4(p, 1);
+}
+
+/**
+ * @return normal in the mesh's space carried to world space
+ */
+glm::vec3 Instance::toWorldNormal(glm::vec3 n) {
+    return glm::normalize(glm::transpose(glm::mat3(toObject)) * n);
+}
+
+/**
+ * @return center of the instance's bounds
+ */
+glm::vec3 Instance::getPosition() {
+    return (bound.min + bound.max) * 0.5f;
+}
+
+BoundingBox Instance::getBounds() {
+    return bound;
+}
+
+Material* Instance::getMaterial() {
+    return mesh->getMaterial();
+}
+
+glm::vec3 Instance::inverseTransform(glm::vec3 p) {
+    return mesh->inverseTransform(toObjectSpace(p));
+}
+
+void Instance::transform(glm::mat4 m) {
+    toWorld = m * toWorld;
+    toObject = glm::inverse(toWorld);
+    setBounds();
+}
+
+float Instance::intersect(glm::vec3 origin, glm::vec3 direction) {
+    float min = INFINITY;
+    Hit hit;
+    intersect(Ray(origin, direction), min, hit);
+    return min;
+}
+
+bool Instance::intersect(BoundingBox& bounds) {
+    // use aabb intersection
+    return bound.intersect(bounds);
+}
+
+/**
+ * Never called: hits on instances resolve to the mesh primitive, which is
+ * shaded in the mesh's space instead, so an instance has no normal itself.
+ */
+glm::vec3 Instance::getNormal(glm::vec3 point) {
+    std::abort();
+}
+
+/**
+ * Calculate axis aligned bounding box from the corners of the mesh's.
+ */
+void Instance::setBounds() {
+
+    BoundingBox local = mesh->getBounds();
+    bound = BoundingBox();
+
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner = glm::vec3(i & 1 ? local.max.x : local.min.x,
+                                     i & 2 ? local.max.y : local.min.y,
+                                     i & 4 ? local.max.z : local.min.z);
+        bound.expand(glm::vec3(toWorld * glm::vec4(corner, 1)));
+    }
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+#include <glm/mat4x4.hpp>
+
+#include "object.h"
+#include "scene.h"
+
+class ThreadPool;
+
+/**
+ * A placement of a shared mesh. The mesh's geometry and acceleration
+ * structure are built once for all of its instances; each instance holds
+ * only its transform, and rays are moved into the mesh's space to trace it.
+ */
+class Instance final : public Primitive {
+
+    private:
+        Mesh* mesh;
+        glm::mat4 toWorld;
+        glm::mat4 toObject;
+        BoundingBox bound;
+        void setBounds();
+        Ray toLocal(const Ray& ray, float& scale);
+
+    public:
+        Instance(Mesh* mesh, glm::vec3 position, glm::vec3 rotation, glm::vec3 scale);
+        Mesh* getMesh();
+        void build(AccelType type, SplitMethod method, ThreadPool* pool);
+        bool intersect(const Ray& ray, float& min, Hit& hit);
+        bool occluded(const Ray& ray, float tmax);
+        glm::vec3 toObjectSpace(glm::vec3 p);
+        glm::vec3 toWorldNormal(glm::vec3 n);
+        virtual glm::vec3 getPosition() override;
+        virtual BoundingBox getBounds() override;
+        virtual Material* getMaterial() override;
+        virtual glm::vec3 inverseTransform(glm::vec3 p) override;
+        virtual void transform(glm::mat4 m) override;
+        virtual float intersect(glm::vec3 origin, glm::vec3 direction) override;
+        virtual bool intersect(BoundingBox& bounds) override;
+        virtual glm::vec3 getNormal(glm::vec3 point) override;
+
+};
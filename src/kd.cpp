@@ -1,101 +1,948 @@
 #include <vector>
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <mutex>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
 
 #include "kd.h"
 #include "object.h"
+#include "pool.h"
+#include "cache.h"
 
 using std::vector;
 
+// mailboxes of live threads, and totals from threads that have exited
+static std::mutex registryLock;
+static vector<Mailbox*> registry;
+static size_t retiredTested = 0;
+static size_t retiredSkipped = 0;
+
+/**
+ * @return index of the calling thread's build arenas
+ */
+static size_t getThread(BuildContext& context) {
+    return (context.pool == nullptr) ? 0 : context.pool->index();
+}
+
+/**
+ * Build a subtree in the calling thread's node arena.
+ */
+static BuildNode* createNode(uint32_t* list, size_t count, uint32_t* centers, size_t centerCount, BoundingBox bound, BuildContext& context, int depth) {
+    return context.nodes[getThread(context)].create<BuildNode>(list, count, centers, centerCount, bound, context, depth);
+}
+
 /**
  * Create a BVH of a set of primitives.
  * @param list primitives to be contained in tree
+ * @param method split plane strategy
+ * @param pool threads to build subtrees on, or null to build serially
  */
-KDTree::KDTree(vector<Primitive*>* list) {
+KDTree::KDTree(vector<Primitive*>* list, SplitMethod method, ThreadPool* pool) {
+
+    primitives = *list;
+    geometry.build(&primitives);
+
+    // calculate initial bounding box, caching per-primitive bounds for the build
+    bound = BoundingBox();
+    vector<uint32_t> all = vector<uint32_t>(primitives.size());
+    vector<BoundingBox> bounds = vector<BoundingBox>(primitives.size());
+    vector<glm::vec3> centroids = vector<glm::vec3>(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++) {
+        bounds[i] = primitives[i]->getBounds();
+        centroids[i] = primitives[i]->getPosition();
+        bound.expand(bounds[i]);
+        all[i] = i;
+    }
 
-    // calculate initial bounding box
-    BoundingBox bound = BoundingBox();
-    for (auto it = list->begin(); it != list->end(); it++) {
-        bound.expand((*it)->getBounds());
+    // generate bvh, limiting SAH depth as suggested by pbrt
+    int depth = KD_MAX_DEPTH - 1;
+    if (method == SAH) {
+        depth = std::min(depth, (int) std::round(KD_DEPTH_BASE + KD_DEPTH_SCALE * std::log2(std::max(list->size(), (size_t) 1))));
     }
+    // build temporaries come from per-thread arenas, freed together on return
+    size_t threads = (pool == nullptr) ? 1 : pool->size() + 1;
+    vector<Arena> nodeArenas(threads);
+    vector<Arena> scratchArenas(threads);
+    BuildContext context = { &bounds, &centroids, method, pool, nodeArenas.data(), scratchArenas.data() };
+    BuildNode* root = createNode(all.data(), all.size(), all.data(), all.size(), bound, context, depth);
+
+    // pack into node array
+    flatten(root, 1);
+
+    for (size_t i = 0; i < threads; i++) {
+        stats.buildBytes += nodeArenas[i].getBytes() + scratchArenas[i].getBytes();
+    }
+
+    stats.nodes = nodes.size();
+    stats.references = indices.size();
+    stats.bytes = nodes.size() * sizeof(Node) + indices.size() * sizeof(uint32_t) + primitives.size() * sizeof(Primitive*) + geometry.getBytes();
+
+}
+
+/**
+ * Append a built subtree to the node array, depth first with each node's
+ * below child directly after it.
+ * @param node subtree to pack
+ * @param depth depth of node
+ */
+void KDTree::flatten(BuildNode* node, size_t depth) {
+
+    uint32_t index = nodes.size();
+    nodes.push_back(Node());
+    stats.depth = std::max(stats.depth, depth);
+
+    if (node->isLeaf()) {
+
+        // group leaf contents by type so each type is tested in one run
+        uint32_t* contents = node->contents;
+        std::sort(contents, contents + node->count, [&](uint32_t a, uint32_t b) {
+            PrimitiveType ta = geometry.getType(a);
+            PrimitiveType tb = geometry.getType(b);
+            return (ta != tb) ? ta < tb : a < b;
+        });
 
-    // generate bvh
-    root = new Node(list, bound);
+        nodes[index].initLeaf(indices.size(), node->count);
+        indices.insert(indices.end(), contents, contents + node->count);
+        stats.leaves++;
+        return;
 
-    // insert primitives
-    for (auto it = list->begin(); it != list->end(); it++) {
-        insert(*it);
     }
 
+    flatten(node->rear, depth + 1);
+    nodes[index].initInterior(node->axis, node->split, nodes.size());
+    flatten(node->front, depth + 1);
+
 }
 
 /**
- * Insert a primitive into the tree.
- * @param obj primitive to insert
+ * Get size statistics for the tree.
+ * @return node, leaf and reference counts and memory footprint
  */
-void KDTree::insert(Primitive* obj) {
-    root->insert(obj);
+TreeStats KDTree::getStats() {
+    return stats;
 }
 
+/**
+ * Write the flattened tree and its gathered geometry to a cache file. Leaves
+ * index the primitive list directly, so no ordering needs to be stored.
+ * @param out cache file to append to
+ * @param list primitives the tree was built from
+ * @return true
+ */
+bool KDTree::save(CacheWriter& out, vector<Primitive*>* list) {
+    out.write(stats);
+    out.write(bound);
+    out.writeArray(nodes);
+    out.writeArray(indices);
+    geometry.save(out);
+    return true;
+}
+
+/**
+ * Restore a tree written by save, checking every child and leaf range and
+ * the depth so a damaged file cannot send traversal out of bounds or past
+ * its fixed stack.
+ * @param in cache file positioned at the tree
+ * @param list primitives equal to those it was built from, in the same order
+ * @return false if the file is invalid
+ */
+bool KDTree::load(CacheReader& in, vector<Primitive*>* list) {
+
+    if (!in.read(stats) || !in.read(bound) || !in.readArray(nodes) || !in.readArray(indices) || nodes.empty()) {
+        return false;
+    }
+
+    // children follow their parents, so a node's depth is known when reached
+    vector<uint32_t> depth(nodes.size(), 0);
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        Node& node = nodes[i];
+        bool valid = node.isLeaf() ? (size_t) node.getOffset() + node.getCount() <= indices.size()
+                                   : i + 1 < nodes.size() && node.getAbove() > i && node.getAbove() < nodes.size()
+                                     && depth[i] + 1 < KD_MAX_DEPTH;
+        if (!valid) {
+            return false;
+        }
+        if (!node.isLeaf()) {
+            depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+            depth[node.getAbove()] = std::max(depth[node.getAbove()], depth[i] + 1);
+        }
+    }
+
+    for (auto it = indices.begin(); it != indices.end(); it++) {
+        if (*it >= list->size()) {
+            return false;
+        }
+    }
+
+    primitives = *list;
+    stats.buildBytes = 0;
+
+    return geometry.load(in, &primitives);
+
+}
+
+Mailbox::Mailbox() : tested(0), skipped(0) {
+    std::lock_guard<std::mutex> guard(registryLock);
+    registry.push_back(this);
+}
+
+Mailbox::~Mailbox() {
+    std::lock_guard<std::mutex> guard(registryLock);
+    retiredTested += tested;
+    retiredSkipped += skipped;
+    registry.erase(std::find(registry.begin(), registry.end(), this));
+}
+
+/**
+ * @return the calling thread's mailbox
+ */
+Mailbox& Mailbox::local() {
+    static thread_local Mailbox mailbox;
+    return mailbox;
+}
+
+/**
+ * Start a new ray.
+ * @param size number of primitives in the tree being traced
+ * @return id of the new ray
+ */
+uint32_t Mailbox::begin(size_t size) {
+
+    if (stamps.size() < size) {
+        stamps.resize(size, 0);
+        masks.resize(size, 0);
+    }
+
+    // on wraparound, forget every stamp
+    if (++ray == 0) {
+        std::fill(stamps.begin(), stamps.end(), 0);
+        ray = 1;
+    }
+
+    return ray;
+
+}
+
+/**
+ * Stamp a primitive for a ray.
+ * @param index primitive index
+ * @param id current ray id
+ * @return true if the primitive was already tested against this ray
+ */
+bool Mailbox::check(uint32_t index, uint32_t id) {
+    if (stamps[index] == id) {
+        return true;
+    }
+    stamps[index] = id;
+    return false;
+}
+
+/**
+ * Stamp a primitive for the rays of a packet, which share one id.
+ * @param index primitive index
+ * @param id current packet id
+ * @param rays bit mask of rays about to test the primitive
+ * @return bit mask of those rays that have not tested it yet
+ */
+uint32_t Mailbox::check(uint32_t index, uint32_t id, uint32_t rays) {
+    if (stamps[index] != id) {
+        stamps[index] = id;
+        masks[index] = 0;
+    }
+    uint32_t untested = rays & ~masks[index];
+    masks[index] |= rays;
+    return untested;
+}
+
+/**
+ * Add the tests performed and skipped by a ray. Only the owning thread
+ * writes, so relaxed updates are enough.
+ */
+void Mailbox::count(size_t tested, size_t skipped) {
+    this->tested.store(this->tested.load(std::memory_order_relaxed) + tested, std::memory_order_relaxed);
+    this->skipped.store(this->skipped.load(std::memory_order_relaxed) + skipped, std::memory_order_relaxed);
+}
+
+/**
+ * Sum primitive tests over all threads since the program started.
+ * @param tested output number of primitive tests performed
+ * @param skipped output number of repeated tests avoided
+ */
+void Mailbox::getCounts(size_t& tested, size_t& skipped) {
+    std::lock_guard<std::mutex> guard(registryLock);
+    tested = retiredTested;
+    skipped = retiredSkipped;
+    for (auto it = registry.begin(); it != registry.end(); it++) {
+        tested += (*it)->tested.load(std::memory_order_relaxed);
+        skipped += (*it)->skipped.load(std::memory_order_relaxed);
+    }
+}
 
 /**
  * Perform an intersection test on the tree.
- * @param origin ray origin
- * @param direction ray direction
- * @return nearest intersection along ray
+ * @param ray ray to trace
+ * @param tmax distance beyond which hits are ignored
+ * @return nearest intersection along ray, with no object if none is nearer
+ *         than tmax
  */
-Hit KDTree::intersect(glm::vec3 origin, glm::vec3 direction) {
+Hit KDTree::intersect(const Ray& ray, float tmax) {
 
-    // find signed distances
+    Hit hit;
+    hit.object = nullptr;
+
+    // find signed distances to root bounds
     float a = -INFINITY;
     float b = INFINITY;
 
-    // for each axis
     for (int i = 0; i < 3; i++) {
+        glm::vec3& near = ray.sign[i] ? bound.max : bound.min;
+        glm::vec3& far = ray.sign[i] ? bound.min : bound.max;
+        a = max(a, (near[i] - ray.origin[i]) * ray.invDirection[i]);
+        b = min(b, (far[i] - ray.origin[i]) * ray.invDirection[i]);
+    }
+
+    if (a > b || b < 0 || a >= tmax) {
+        return hit;
+    }
+
+    float min = tmax;
+    traverse(ray, 0, a, b, hit, min);
+    hit.point = ray.origin + ray.direction * min;
+    hit.distance = min;
+    return hit;
+
+}
+
+/**
+ * Trace a single ray through a subtree. Nodes are visited front to back
+ * with far children deferred on a fixed-size stack, stopping as soon as a hit
+ * is found inside the interval of the node being visited.
+ * @param ray ray to trace
+ * @param node index of subtree root
+ * @param a distance at which the ray enters the subtree
+ * @param b distance at which the ray leaves the subtree
+ * @param hit nearest hit so far, updated in place
+ * @param min distance to nearest hit so far, updated in place
+ */
+void KDTree::traverse(const Ray& ray, uint32_t node, float a, float b, Hit& hit, float& min) {
+
+    typedef struct Entry {
+        uint32_t node;
+        float a, b;
+    } Entry;
+
+    Entry stack[KD_MAX_DEPTH];
+    int top = 0;
+
+    Mailbox& mailbox = Mailbox::local();
+    uint32_t id = mailbox.begin(primitives.size());
+    size_t tested = 0;
+    size_t skipped = 0;
+
+    while (true) {
+
+        const Node& current = nodes[node];
+
+        if (!current.isLeaf()) {
+
+            // which direction are we crossing the plane?
+            int axis = current.getAxis();
+            float d = current.getSplit();
+            uint32_t near = node + 1;
+            uint32_t far = current.getAbove();
+            if (ray.origin[axis] > d) {
+                std::swap(near, far);
+            }
+
+            float s = (d - ray.origin[axis]) * ray.invDirection[axis];
+
+            if (s < 0 || s > b || glm::abs(ray.direction[axis]) < EPSILON) {
+                // traverse near node
+                node = near;
+            } else if (s < a) {
+                // traverse far node
+                node = far;
+            } else {
+                // traverse both, near->far
+                stack[top++] = { far, s, b };
+                node = near;
+                b = s;
+            }
+
+            continue;
+
+        }
+
+        // find closest intersection in leaf
+        const uint32_t* contents = &indices[current.getOffset()];
+
+        for (uint32_t i = 0; i < current.getCount(); i++) {
+
+            // already tested in an earlier leaf
+            if (mailbox.check(contents[i], id)) {
+                skipped++;
+                continue;
+            }
+
+            tested++;
+            geometry.intersect(ray, contents[i], min, hit);
+
+        }
+
+        // no later node can contain a nearer hit
+        if (min <= b) {
+            break;
+        }
+
+        // resume at the next deferred node, unless the hit precedes it
+        if (top == 0 || min < stack[top - 1].a) {
+            break;
+        }
+
+        top--;
+        node = stack[top].node;
+        a = stack[top].a;
+        b = stack[top].b;
+
+    }
+
+    mailbox.count(tested, skipped);
+
+}
+
+/**
+ * Test whether anything lies along a ray segment. Traversal stops at the
+ * first intersection found, which need not be the nearest.
+ * @param ray ray to trace
+ * @param tmax length of the segment
+ * @return true if some primitive is hit within (0, tmax)
+ */
+bool KDTree::occluded(const Ray& ray, float tmax) {
+
+    // find signed distances to root bounds, clipped to the segment
+    float a = -INFINITY;
+    float b = tmax;
+
+    for (int i = 0; i < 3; i++) {
+        glm::vec3& near = ray.sign[i] ? bound.max : bound.min;
+        glm::vec3& far = ray.sign[i] ? bound.min : bound.max;
+        a = max(a, (near[i] - ray.origin[i]) * ray.invDirection[i]);
+        b = min(b, (far[i] - ray.origin[i]) * ray.invDirection[i]);
+    }
+
+    if (a > b || b < 0) {
+        return false;
+    }
+
+    return traverseAny(ray, 0, a, b, tmax);
+
+}
+
+/**
+ * Test a single ray segment for blockers in a subtree, the any-hit
+ * counterpart of traverse.
+ * @param ray ray to trace
+ * @param node index of subtree root
+ * @param a distance at which the ray enters the subtree
+ * @param b distance at which the ray leaves the subtree, at most tmax
+ * @param tmax length of the segment
+ * @return true if some primitive in the subtree is hit within (0, tmax)
+ */
+bool KDTree::traverseAny(const Ray& ray, uint32_t node, float a, float b, float tmax) {
+
+    typedef struct Entry {
+        uint32_t node;
+        float a, b;
+    } Entry;
+
+    Entry stack[KD_MAX_DEPTH];
+    int top = 0;
+
+    Mailbox& mailbox = Mailbox::local();
+    uint32_t id = mailbox.begin(primitives.size());
+    size_t tested = 0;
+    size_t skipped = 0;
+
+    while (true) {
+
+        const Node& current = nodes[node];
+
+        if (!current.isLeaf()) {
+
+            int axis = current.getAxis();
+            float d = current.getSplit();
+            uint32_t near = node + 1;
+            uint32_t far = current.getAbove();
+            if (ray.origin[axis] > d) {
+                std::swap(near, far);
+            }
+
+            float s = (d - ray.origin[axis]) * ray.invDirection[axis];
+
+            if (s < 0 || s > b || glm::abs(ray.direction[axis]) < EPSILON) {
+                node = near;
+            } else if (s < a) {
+                node = far;
+            } else {
+                stack[top++] = { far, s, b };
+                node = near;
+                b = s;
+            }
+
+            continue;
+
+        }
+
+        // any hit within the segment will do
+        const uint32_t* contents = &indices[current.getOffset()];
+
+        for (uint32_t i = 0; i < current.getCount(); i++) {
+
+            if (mailbox.check(contents[i], id)) {
+                skipped++;
+                continue;
+            }
+
+            tested++;
+            if (geometry.occluded(ray, contents[i], tmax)) {
+                mailbox.count(tested, skipped);
+                return true;
+            }
+
+        }
+
+        if (top == 0) {
+            mailbox.count(tested, skipped);
+            return false;
+        }
+
+        top--;
+        node = stack[top].node;
+        a = stack[top].a;
+        b = stack[top].b;
+
+    }
+
+}
+
+/**
+ * Subtree deferred by a packet, with the interval of each ray reaching it.
+ */
+typedef struct PacketEntry {
+    uint32_t node;
+    uint32_t mask;
+    alignas(16) float a[PACKET_SIZE];
+    alignas(16) float b[PACKET_SIZE];
+} PacketEntry;
+
+/**
+ * @return true if the rays point the same way along every axis, so they
+ *         cross each split plane in the same order
+ */
+static bool isCoherent(const Ray* rays, int count) {
+    for (int i = 1; i < count; i++) {
+        if (rays[i].sign[0] != rays[0].sign[0] || rays[i].sign[1] != rays[0].sign[1] || rays[i].sign[2] != rays[0].sign[2]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Clip each ray of a packet to the tree bounds, from its origin to its
+ * length in the packet.
+ * @param bound bounds of the tree
+ * @param rays rays of the packet
+ * @param packet the same rays with their lengths
+ * @param count number of rays
+ * @param a output distance at which each ray enters the bounds
+ * @param b output distance at which each ray leaves them
+ * @return bit mask of rays that pass through the bounds
+ */
+static uint32_t clipPacket(const BoundingBox& bound, const Ray* rays, const Packet& packet, int count, float* a, float* b) {
+
+    uint32_t mask = 0;
+
+    for (int i = 0; i < PACKET_SIZE; i++) {
+
+        a[i] = 0;
+        b[i] = packet.tmax[i];
+
+        if (i >= count) {
+            continue;
+        }
+
+        for (int k = 0; k < 3; k++) {
+            const glm::vec3& near = rays[i].sign[k] ? bound.max : bound.min;
+            const glm::vec3& far = rays[i].sign[k] ? bound.min : bound.max;
+            a[i] = max(a[i], (near[k] - rays[i].origin[k]) * rays[i].invDirection[k]);
+            b[i] = min(b[i], (far[k] - rays[i].origin[k]) * rays[i].invDirection[k]);
+        }
+
+        if (a[i] <= b[i]) {
+            mask |= 1u << i;
+        }
+
+    }
+
+    return mask;
+
+}
+
+/**
+ * Step a packet through an interior node. Each active ray's interval is
+ * split at the plane, and the packet moves on to the near child with the
+ * rays reaching it, deferring the far child for the rest, or straight to
+ * the far child if no ray reaches the near one. Intervals of inactive rays
+ * may be overwritten, as they are restored from the stack.
+ * @param current interior node
+ * @param node index of the node, updated to the child visited next
+ * @param packet rays, all pointing the same way as sign
+ * @param sign direction signs shared by the rays
+ * @param a entry distance of each ray, updated for the next child
+ * @param b exit distance of each ray, updated for the next child
+ * @param mask active rays, updated for the next child
+ * @param stack stack of deferred subtrees
+ * @param top stack size, updated
+ */
+static void splitPacket(const Node& current, uint32_t& node, const Packet& packet, const int* sign, float* a, float* b, uint32_t& mask, PacketEntry* stack, int& top) {
+
+    // the rays agree on direction, so they agree on the near side
+    int axis = current.getAxis();
+    float d = current.getSplit();
+    uint32_t near = node + 1;
+    uint32_t far = current.getAbove();
+    if (sign[axis]) {
+        std::swap(near, far);
+    }
+
+    // split each interval at the plane; a ray lying in it takes both sides
+    alignas(16) float s[PACKET_SIZE];
+    uint32_t nearMask = 0;
+    uint32_t farMask = 0;
+
+#ifdef __SSE__
+
+    for (int g = 0; g < PACKET_SIZE; g += 4) {
+        __m128 t = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(d), _mm_load_ps(packet.origin[axis] + g)), _mm_load_ps(packet.invDirection[axis] + g));
+        _mm_store_ps(s + g, t);
+        nearMask |= _mm_movemask_ps(_mm_cmpnlt_ps(t, _mm_load_ps(a + g))) << g;
+        farMask |= _mm_movemask_ps(_mm_cmpngt_ps(t, _mm_load_ps(b + g))) << g;
+    }
+
+#else
+
+    for (int i = 0; i < PACKET_SIZE; i++) {
+        s[i] = (d - packet.origin[axis][i]) * packet.invDirection[axis][i];
+        nearMask |= (uint32_t) !(s[i] < a[i]) << i;
+        farMask |= (uint32_t) !(s[i] > b[i]) << i;
+    }
+
+#endif
+
+    nearMask &= mask;
+    farMask &= mask;
+
+    // defer the far child for the rays that reach it
+    if (nearMask != 0 && farMask != 0) {
+        PacketEntry& entry = stack[top++];
+        entry.node = far;
+        entry.mask = farMask;
+        for (int i = 0; i < PACKET_SIZE; i++) {
+            entry.a[i] = s[i] > a[i] ? s[i] : a[i];
+            entry.b[i] = b[i];
+        }
+    }
+
+    if (nearMask != 0) {
+        for (int i = 0; i < PACKET_SIZE; i++) {
+            b[i] = s[i] < b[i] ? s[i] : b[i];
+        }
+        node = near;
+        mask = nearMask;
+    } else {
+        for (int i = 0; i < PACKET_SIZE; i++) {
+            a[i] = s[i] > a[i] ? s[i] : a[i];
+        }
+        node = far;
+        mask = farMask;
+    }
+
+}
+
+/**
+ * Pop deferred subtrees until one is reached by a ray whose length in the
+ * packet does not end before it, restoring the intervals of those rays.
+ * @param stack stack of deferred subtrees
+ * @param top stack size, updated
+ * @param node output index of the subtree to visit
+ * @param packet rays with their current lengths
+ * @param a output entry distance of each ray
+ * @param b output exit distance of each ray
+ * @return bit mask of rays to visit the subtree with, or 0 once the stack is empty
+ */
+static uint32_t resumePacket(PacketEntry* stack, int& top, uint32_t& node, const Packet& packet, float* a, float* b) {
+
+    while (top > 0) {
+
+        PacketEntry& entry = stack[--top];
+        uint32_t mask = 0;
+
+        for (int i = 0; i < PACKET_SIZE; i++) {
+            if ((entry.mask & (1u << i)) && !(entry.a[i] > packet.tmax[i])) {
+                mask |= 1u << i;
+            }
+            a[i] = entry.a[i];
+            b[i] = entry.b[i];
+        }
+
+        if (mask != 0) {
+            node = entry.node;
+            return mask;
+        }
+
+    }
+
+    return 0;
+
+}
+
+/**
+ * Trace a packet of rays together. Each ray keeps its own interval, and the
+ * packet descends into a child with the rays whose interval reaches it. Once
+ * few rays remain active they finish the subtree one by one. Rays must point
+ * the same way along every axis, or they are traced alone. The mailbox
+ * records which rays of the packet have tested each primitive.
+ * @param rays rays to trace
+ * @param count number of rays, at most PACKET_SIZE
+ * @param hits output nearest intersection for each ray
+ */
+void KDTree::intersectPacket(const Ray* rays, int count, Hit* hits) {
+
+    if (!isCoherent(rays, count)) {
+        Accelerator::intersectPacket(rays, count, hits);
+        return;
+    }
+
+    Packet packet;
+    initPacket(packet, rays, count, nullptr);
+
+    for (int i = 0; i < count; i++) {
+        hits[i] = Hit();
+    }
+
+    alignas(16) float a[PACKET_SIZE];
+    alignas(16) float b[PACKET_SIZE];
+    uint32_t mask = clipPacket(bound, rays, packet, count, a, b);
+
+    PacketEntry stack[KD_MAX_DEPTH];
+    int top = 0;
+    uint32_t node = 0;
+
+    Mailbox& mailbox = Mailbox::local();
+    uint32_t id = mailbox.begin(primitives.size());
+    size_t tested = 0;
+    size_t skipped = 0;
+
+    while (mask != 0) {
+
+        const Node& current = nodes[node];
+
+        if (std::bitset<32>(mask).count() <= PACKET_SPLIT) {
+
+            // rays have diverged, finish this subtree individually
+            for (int i = 0; i < count; i++) {
+                if (mask & (1u << i)) {
+                    traverse(rays[i], node, a[i], b[i], hits[i], packet.tmax[i]);
+                }
+            }
+
+        } else if (!current.isLeaf()) {
+
+            splitPacket(current, node, packet, rays[0].sign, a, b, mask, stack, top);
+            continue;
 
-        if (direction[i] >= 0) {
-            a = max(a, (root->bound.min[i] - origin[i]) / direction[i]);
-            b = min(b, (root->bound.max[i] - origin[i]) / direction[i]);
         } else {
-            a = max(a, (root->bound.max[i] - origin[i]) / direction[i]);
-            b = min(b, (root->bound.min[i] - origin[i]) / direction[i]);
+
+            // find closest intersection in leaf for each active ray not yet tested
+            const uint32_t* contents = &indices[current.getOffset()];
+
+            for (uint32_t k = 0; k < current.getCount(); k++) {
+
+                uint32_t untested = mailbox.check(contents[k], id, mask);
+                size_t n = std::bitset<32>(untested).count();
+                tested += n;
+                skipped += std::bitset<32>(mask).count() - n;
+
+                for (int i = 0; i < count; i++) {
+                    if (untested & (1u << i)) {
+                        geometry.intersect(rays[i], contents[k], packet.tmax[i], hits[i]);
+                    }
+                }
+
+            }
+
+        }
+
+        // resume at the next deferred node with the rays whose hit does not precede it
+        mask = resumePacket(stack, top, node, packet, a, b);
+
+    }
+
+    mailbox.count(tested, skipped);
+
+    for (int i = 0; i < count; i++) {
+        hits[i].point = rays[i].origin + rays[i].direction * packet.tmax[i];
+        hits[i].distance = packet.tmax[i];
+    }
+
+}
+
+/**
+ * Test a packet of ray segments for blockers together, splitting intervals
+ * at each plane as intersectPacket does. A ray leaves the packet once it is
+ * blocked, and traversal ends when every ray is. Once few rays remain
+ * active they finish the subtree one by one.
+ * @param rays rays to trace
+ * @param tmax length of each segment
+ * @param count number of rays, at most PACKET_SIZE
+ * @param blocked output whether each segment is blocked
+ */
+void KDTree::occludedPacket(const Ray* rays, const float* tmax, int count, bool* blocked) {
+
+    if (!isCoherent(rays, count)) {
+        Accelerator::occludedPacket(rays, tmax, count, blocked);
+        return;
+    }
+
+    Packet packet;
+    initPacket(packet, rays, count, tmax);
+
+    for (int i = 0; i < count; i++) {
+        blocked[i] = false;
+    }
+
+    alignas(16) float a[PACKET_SIZE];
+    alignas(16) float b[PACKET_SIZE];
+    uint32_t mask = clipPacket(bound, rays, packet, count, a, b);
+    uint32_t open = (count >= 32) ? ~0u : (1u << count) - 1;
+
+    PacketEntry stack[KD_MAX_DEPTH];
+    int top = 0;
+    uint32_t node = 0;
+
+    Mailbox& mailbox = Mailbox::local();
+    uint32_t id = mailbox.begin(primitives.size());
+    size_t tested = 0;
+    size_t skipped = 0;
+
+    while (mask != 0) {
+
+        const Node& current = nodes[node];
+
+        if (std::bitset<32>(mask).count() <= PACKET_SPLIT) {
+
+            // rays have diverged, finish this subtree individually
+            for (int i = 0; i < count; i++) {
+                if ((mask & (1u << i)) && traverseAny(rays[i], node, a[i], b[i], tmax[i])) {
+                    blocked[i] = true;
+                    open &= ~(1u << i);
+                    packet.tmax[i] = -INFINITY;
+                }
+            }
+
+        } else if (!current.isLeaf()) {
+
+            splitPacket(current, node, packet, rays[0].sign, a, b, mask, stack, top);
+            continue;
+
+        } else {
+
+            // any hit within its segment retires a ray
+            const uint32_t* contents = &indices[current.getOffset()];
+
+            for (uint32_t k = 0; k < current.getCount() && mask != 0; k++) {
+
+                uint32_t untested = mailbox.check(contents[k], id, mask);
+                size_t n = std::bitset<32>(untested).count();
+                tested += n;
+                skipped += std::bitset<32>(mask).count() - n;
+
+                for (int i = 0; i < count; i++) {
+                    if ((untested & (1u << i)) && geometry.occluded(rays[i], contents[k], tmax[i])) {
+                        blocked[i] = true;
+                        open &= ~(1u << i);
+                        mask &= ~(1u << i);
+                        // no deferred subtree begins before a negative length
+                        packet.tmax[i] = -INFINITY;
+                    }
+                }
+
+            }
+
         }
-        
+
+        if (open == 0) {
+            break;
+        }
+
+        mask = resumePacket(stack, top, node, packet, a, b);
+
     }
 
-    // start recursive traversal
-    return root->intersect(origin, direction, a, b);
+    mailbox.count(tested, skipped);
+
 }
 
 /**
  * Recursively create a bounding hierarchy for a given set of primitives.
- * @param list primitives to be contained in subtree
+ * Leaves keep every primitive whose bounds overlap them, in list order.
+ * @param list indices of primitives overlapping the node
+ * @param count length of list
+ * @param centers indices of primitives whose centroids fall in the node, used
+ *                to place midpoint splits (the same list as above for SAH)
+ * @param centerCount length of centers
  * @param bound bounding box to be divided
+ * @param context primitives, split strategy, thread pool and arenas
+ * @param depth remaining levels allowed below this node
  */
-Node::Node(vector<Primitive*>* list, BoundingBox bound) {
+BuildNode::BuildNode(uint32_t* list, size_t count, uint32_t* centers, size_t centerCount, BoundingBox bound, BuildContext& context, int depth) {
 
     // create bounding box
     this->bound = bound;
-    BoundingBox centers = BoundingBox();
 
-    for (auto it = list->begin(); it != list->end(); it++) {
-        centers.expand((*it)->getPosition());
-    }
+    // large nodes may evaluate split candidates in parallel too
+    ThreadPool* pool = (count >= KD_FORK_SIZE) ? context.pool : nullptr;
 
-    // get largest axis
-    glm::vec3 size = centers.max - centers.min;
-    int axis = (size.x > size.y) && (size.x > size.z) ? 0 : (size.y > size.z) ? 1 : 2;
+    // choose split plane
+    int axis;
+    float position;
+    bool split = depth > 0 && ((context.method == SAH) ? splitSAH(list, count, context, pool, axis, position) : splitMidpoint(centers, centerCount, context, axis, position));
 
     // recursion base case
-    if (list->size() < 3 || size[axis] < EPSILON) {
+    if (!split) {
         // node is a leaf
-        contents = new vector<Primitive*>();
+        this->count = count;
+        contents = context.nodes[getThread(context)].allocate<uint32_t>(count);
+        std::copy(list, list + count, contents);
         return;
     }
 
-    // partition (in half for now)
-    vector<Primitive*>* front = new vector<Primitive*>();
-    vector<Primitive*>* rear = new vector<Primitive*>();
-    float position = centers.min[axis] + size[axis] / 2.0f;
-    this->plane = new Plane(axis, position);
+    this->axis = axis;
+    this->split = position;
+
+    // child lists live until both subtrees are built, then the space is reused
+    Arena& scratch = context.scratch[getThread(context)];
+    Arena::Mark mark = scratch.getMark();
+    uint32_t* front = scratch.allocate<uint32_t>(count);
+    uint32_t* rear = scratch.allocate<uint32_t>(count);
+    size_t frontCount = 0;
+    size_t rearCount = 0;
 
     // divide bounding box along plane
     glm::vec3 midmin = bound.min;
@@ -104,105 +951,260 @@ Node::Node(vector<Primitive*>* list, BoundingBox bound) {
     midmax[axis] = position;
     BoundingBox rearBound = BoundingBox(bound.min, midmax);
     BoundingBox frontBound = BoundingBox(midmin, bound.max);
-    float test = 0;
 
-    // partition list of primitives by position
-    for (auto it = list->begin(); it != list->end(); it++) {
-        test = (*it)->getPosition()[axis];
-        test > position ? front->push_back(*it) : rear->push_back(*it);
+    // partition list of primitives by bounds overlap
+    for (size_t i = 0; i < count; i++) {
+        if ((*context.bounds)[list[i]].intersect(frontBound)) { front[frontCount++] = list[i]; }
+        if ((*context.bounds)[list[i]].intersect(rearBound)) { rear[rearCount++] = list[i]; }
     }
 
-    // create front & back nodes
-    this->front = new Node(front, frontBound);
-    delete front;
-    this->rear = new Node(rear, rearBound);    
-    delete rear;
+    // midpoint splits are placed by position
+    uint32_t* frontCenters = front;
+    uint32_t* rearCenters = rear;
+    size_t frontCenterCount = frontCount;
+    size_t rearCenterCount = rearCount;
 
-}
+    if (context.method == MIDPOINT) {
+        frontCenters = scratch.allocate<uint32_t>(centerCount);
+        rearCenters = scratch.allocate<uint32_t>(centerCount);
+        frontCenterCount = 0;
+        rearCenterCount = 0;
+        float test = 0;
+        for (size_t i = 0; i < centerCount; i++) {
+            test = (*context.centroids)[centers[i]][axis];
+            if (test > position) {
+                frontCenters[frontCenterCount++] = centers[i];
+            } else {
+                rearCenters[rearCenterCount++] = centers[i];
+            }
+        }
+    }
+
+    // create front & back nodes, forking the front subtree if it is large
+    if (pool != nullptr) {
+        TaskGroup group(*pool);
+        group.run([&] { this->front = createNode(front, frontCount, frontCenters, frontCenterCount, frontBound, context, depth - 1); });
+        this->rear = createNode(rear, rearCount, rearCenters, rearCenterCount, rearBound, context, depth - 1);
+        group.wait();
+    } else {
+        this->front = createNode(front, frontCount, frontCenters, frontCenterCount, frontBound, context, depth - 1);
+        this->rear = createNode(rear, rearCount, rearCenters, rearCenterCount, rearBound, context, depth - 1);
+    }
+
+    scratch.rewind(mark);
 
-/**
- * @return true if the node is a leaf node
- */
-bool Node::isLeaf() {
-    return (front == nullptr && rear == nullptr);
 }
 
 /**
- * Recursively insert a primitive into the subtree.
- * @param obj primitive to insert
+ * Split the centroid bounds in half along their largest axis.
+ * @param list indices of primitives contained in node
+ * @param context primitives being built over
+ * @param axis output split axis
+ * @param position output split position
+ * @return false if the node should be a leaf
  */
-void Node::insert(Primitive* obj) {
+bool BuildNode::splitMidpoint(uint32_t* list, size_t count, BuildContext& context, int& axis, float& position) {
 
-    // if leaf node, store
-    if (isLeaf()) {
-        contents->push_back(obj);
-        return;
-    }
+    BoundingBox centers = BoundingBox();
 
-    if (front != nullptr && obj->intersect(front->bound)) {
-        front->insert(obj);
+    for (size_t i = 0; i < count; i++) {
+        centers.expand((*context.centroids)[list[i]]);
     }
 
-    if (rear != nullptr && obj->intersect(rear->bound)) {
-        rear->insert(obj);
+    // get largest axis
+    glm::vec3 size = centers.max - centers.min;
+    axis = (size.x > size.y) && (size.x > size.z) ? 0 : (size.y > size.z) ? 1 : 2;
+
+    if (count < 3 || size[axis] < EPSILON) {
+        return false;
     }
 
+    // partition (in half)
+    position = centers.min[axis] + size[axis] / 2.0f;
+    return true;
+
 }
 
 /**
- * Recursively perform an intersection test on the subtree.
- * @param origin ray origin
- * @param direction ray direction
- * @param a signed distance along ray of first intersection
- * @param b signed distance along ray of second intersection
- * @return nearest intersection along ray in subtree
+ * Choose the split plane with the lowest surface area heuristic cost. The
+ * candidates are the primitive bound edges inside the node on each axis.
+ * @param list indices of primitives contained in node
+ * @param context primitives being built over
+ * @param pool threads to sweep the three axes on, or null
+ * @param axis output split axis
+ * @param position output split position
+ * @return false if no split is cheaper than intersecting every primitive
  */
-Hit Node::intersect(glm::vec3 origin, glm::vec3 direction, float a, float b) {
-    
-    // base case: test intersection
-    if (isLeaf()) {
+bool BuildNode::splitSAH(uint32_t* list, size_t count, BuildContext& context, ThreadPool* pool, int& axis, float& position) {
+
+    typedef struct Edge {
+        float t;
+        bool start;
+    } Edge;
+
+    size_t n = count;
+    glm::vec3 size = bound.max - bound.min;
+    float area = 2 * (size.x * size.y + size.x * size.z + size.y * size.z);
+
+    if (n == 0 || !(area > 0)) {
+        return false;
+    }
+
+    // cost of making this node a leaf
+    float leafCost = KD_INTERSECT_COST * n;
+    float bestCost[3] = { leafCost, leafCost, leafCost };
+    float bestPosition[3];
+
+    auto sweep = [&](int a) {
+
+        // each axis may be swept on a different thread
+        Arena& scratch = context.scratch[getThread(context)];
+        Arena::Mark mark = scratch.getMark();
+        Edge* edges = scratch.allocate<Edge>(2 * n);
+
+        // bound edges clipped to node, starts before ends at equal positions so
+        // a flat primitive is counted on one side of a plane through it
+        for (size_t i = 0; i < n; i++) {
+            BoundingBox& b = (*context.bounds)[list[i]];
+            edges[2 * i] = { glm::max(b.min[a], bound.min[a]), true };
+            edges[2 * i + 1] = { glm::min(b.max[a], bound.max[a]), false };
+        }
+
+        std::sort(edges, edges + 2 * n, [](const Edge& e1, const Edge& e2) {
+            return e1.t < e2.t || (e1.t == e2.t && e1.start && !e2.start);
+        });
+
+        // sweep plane along axis, tracking primitive counts on each side
+        int u = (a + 1) % 3;
+        int v = (a + 2) % 3;
+        float cap = size[u] * size[v];
+        float perimeter = size[u] + size[v];
+        size_t below = 0;
+        size_t above = n;
+
+        for (Edge* it = edges; it != edges + 2 * n; it++) {
+
+            if (!it->start) {
+                above--;
+            }
+
+            if (it->t > bound.min[a] && it->t < bound.max[a]) {
+
+                float belowArea = 2 * (cap + (it->t - bound.min[a]) * perimeter);
+                float aboveArea = 2 * (cap + (bound.max[a] - it->t) * perimeter);
+                float bonus = (below == 0 || above == 0) ? KD_EMPTY_BONUS : 0.0f;
+                float cost = KD_TRAVERSAL_COST + KD_INTERSECT_COST * (1.0f - bonus) * (belowArea * below + aboveArea * above) / area;
 
-        float dist;
-        float min = INFINITY;
-        int index = -1;
+                if (cost < bestCost[a]) {
+                    bestCost[a] = cost;
+                    bestPosition[a] = it->t;
+                }
 
-        // find closest intersection
-        for (size_t i = 0; i < contents->size(); i++) {
-            if ((dist = (*contents)[i]->intersect(origin, direction)) < min && dist > 0) {
-                min = dist;
-                index = i;
             }
+
+            if (it->start) {
+                below++;
+            }
+
         }
 
-        // create return value
-        Hit hit;
-        hit.object = (index >= 0)? (*contents)[index] : nullptr;
-        hit.point = origin + direction * min;
-        return hit;
+        scratch.rewind(mark);
 
-    }
+    };
 
-    // which direction are we crossing the plane?
-    bool originInFront = origin[plane->axis] > plane->d;
-    float s = (plane->d - origin[plane->axis]) / direction[plane->axis]; 
-    
-    if (s < 0 || s > b || glm::abs(direction[plane->axis]) < EPSILON) {
-        // traverse near node
-        return (originInFront) ? front->intersect(origin, direction, a, b) : rear->intersect(origin, direction, a, b);
-    } else if (s < a) {
-        // traverse far node
-        return (originInFront) ? rear->intersect(origin, direction, a, b) : front->intersect(origin, direction, a, b);
+    if (pool != nullptr) {
+        TaskGroup group(*pool);
+        group.run([&] { sweep(0); });
+        group.run([&] { sweep(1); });
+        sweep(2);
+        group.wait();
     } else {
-        
-        // traverse both, near->far
-        Hit near = (originInFront) ? front->intersect(origin, direction, a, s) : rear->intersect(origin, direction, a, s);
-        
-        if (near.object == nullptr) {
-            return (originInFront) ? rear->intersect(origin, direction, s, b) : front->intersect(origin, direction, s, b);
-        } else {
-            return near;
+        for (int a = 0; a < 3; a++) {
+            sweep(a);
         }
+    }
 
+    // lowest cost wins, earlier axes on ties
+    axis = -1;
+    float best = leafCost;
+    for (int a = 0; a < 3; a++) {
+        if (bestCost[a] < best) {
+            best = bestCost[a];
+            axis = a;
+            position = bestPosition[a];
+        }
     }
 
-}
\ No newline at end of file
+    return axis >= 0;
+
+}
+
+/**
+ * @return true if the node is a leaf node
+ */
+bool BuildNode::isLeaf() {
+    return (front == nullptr && rear == nullptr);
+}
+
+/**
+ * Make the node a leaf.
+ * @param offset first entry in the tree's index array
+ * @param count number of primitives
+ */
+void Node::initLeaf(uint32_t offset, uint32_t count) {
+    this->offset = offset;
+    this->flags = (count << 2) | 3;
+}
+
+/**
+ * Make the node an interior node.
+ * @param axis split axis
+ * @param split split position
+ * @param above index of the child above the plane
+ */
+void Node::initInterior(int axis, float split, uint32_t above) {
+    this->split = split;
+    this->flags = (above << 2) | axis;
+}
+
+/**
+ * @return true if the node is a leaf node
+ */
+bool Node::isLeaf() const {
+    return (flags & 3) == 3;
+}
+
+/**
+ * @return split axis of an interior node
+ */
+int Node::getAxis() const {
+    return flags & 3;
+}
+
+/**
+ * @return split position of an interior node
+ */
+float Node::getSplit() const {
+    return split;
+}
+
+/**
+ * @return index of the child above the split plane of an interior node
+ */
+uint32_t Node::getAbove() const {
+    return flags >> 2;
+}
+
+/**
+ * @return first index array entry of a leaf
+ */
+uint32_t Node::getOffset() const {
+    return offset;
+}
+
+/**
+ * @return number of primitives in a leaf
+ */
+uint32_t Node::getCount() const {
+    return flags >> 2;
+}
@@ -1,39 +1,150 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <vector>
 #include <glm/vec3.hpp>
 
+#include "accel.h"
+#include "arena.h"
 #include "bounding.h"
 #include "scene.h"
+#include "geometry.h"
 
 class Primitive;
+class ThreadPool;
 
 using std::vector;
 
-class Node {
+// SAH cost of stepping through an interior node
+#define KD_TRAVERSAL_COST 1.0f
+
+// SAH cost of a single ray-primitive intersection test
+#define KD_INTERSECT_COST 80.0f
+
+// fraction of cost discounted for splits that cut off empty space
+#define KD_EMPTY_BONUS 0.5f
+
+// maximum tree depth, which bounds the traversal stack
+#define KD_MAX_DEPTH 64
+
+// SAH trees stop at KD_DEPTH_BASE + KD_DEPTH_SCALE * log2(primitives) levels
+#define KD_DEPTH_BASE 8
+#define KD_DEPTH_SCALE 1.3f
+
+// subtrees with at least this many primitives are built as separate tasks
+#define KD_FORK_SIZE 1024
+
+typedef struct BuildContext {
+    vector<BoundingBox>* bounds;    // primitive bounds, indexed like leaf contents
+    vector<glm::vec3>* centroids;   // primitive positions
+    SplitMethod method;
+    ThreadPool* pool;   // null to build on the calling thread
+    Arena* nodes;       // per thread: build nodes and leaf contents
+    Arena* scratch;     // per thread: partition lists, rewound once a subtree is built
+} BuildContext;
+
+/**
+ * Temporary pointer-based node used while building the tree, allocated in
+ * the build arenas and released with them. Leaf contents are indices into
+ * the tree's primitive list.
+ */
+class BuildNode {
 
     private:
-        Plane* plane = nullptr;
-        Node *front = nullptr, *rear = nullptr;
-        vector<Primitive*>* contents = nullptr;
-        bool isLeaf();
+        bool splitMidpoint(uint32_t* list, size_t count, BuildContext& context, int& axis, float& position);
+        bool splitSAH(uint32_t* list, size_t count, BuildContext& context, ThreadPool* pool, int& axis, float& position);
 
     public:
+        int axis = 0;
+        float split = 0;
+        BuildNode *front = nullptr, *rear = nullptr;
+        uint32_t* contents = nullptr;
+        uint32_t count = 0;
         BoundingBox bound;
-        Node(vector<Primitive*>* list, BoundingBox bound);
-        void insert(Primitive* obj);
-        Hit intersect(glm::vec3 origin, glm::vec3 direction, float a, float b);
+        BuildNode(uint32_t* list, size_t count, uint32_t* centers, size_t centerCount, BoundingBox bound, BuildContext& context, int depth);
+        bool isLeaf();
+
+};
+
+/**
+ * Compact 8-byte k-d tree node. Interior nodes hold the split axis and
+ * position; the child below the plane follows the node directly and the
+ * child above it is at a stored index. Leaves hold a range of the tree's
+ * shared primitive index array.
+ */
+class Node {
+
+    private:
+        union {
+            float split;        // interior: split position
+            uint32_t offset;    // leaf: first entry in index array
+        };
+        uint32_t flags;         // low 2 bits: axis, or 3 for a leaf; high 30 bits: above child or primitive count
+
+    public:
+        void initLeaf(uint32_t offset, uint32_t count);
+        void initInterior(int axis, float split, uint32_t above);
+        bool isLeaf() const;
+        int getAxis() const;
+        float getSplit() const;
+        uint32_t getAbove() const;
+        uint32_t getOffset() const;
+        uint32_t getCount() const;
+
+};
+
+static_assert(sizeof(Node) == 8, "k-d tree nodes must stay 8 bytes");
+
+/**
+ * Per-thread record of the last ray each primitive was tested against.
+ * Primitives overlapping a split are referenced by several leaves, and the
+ * stamp lets a ray skip those it has already tested. Ray ids only grow, so
+ * stamps left by other trees can never match the current ray.
+ */
+class Mailbox {
+
+    private:
+        vector<uint32_t> stamps;
+        vector<uint32_t> masks;     // rays of the stamping packet that tested each primitive
+        uint32_t ray = 0;
+        std::atomic<size_t> tested;
+        std::atomic<size_t> skipped;
+
+    public:
+        Mailbox();
+        ~Mailbox();
+        uint32_t begin(size_t size);
+        bool check(uint32_t index, uint32_t id);
+        uint32_t check(uint32_t index, uint32_t id, uint32_t rays);
+        void count(size_t tested, size_t skipped);
+        static Mailbox& local();
+        static void getCounts(size_t& tested, size_t& skipped);
 
 };
 
-class KDTree {
+class KDTree : public Accelerator {
     
     private:
-        Node* root;
+        BoundingBox bound;
+        vector<Node> nodes;
+        vector<uint32_t> indices;
+        vector<Primitive*> primitives;
+        Geometry geometry;
+        TreeStats stats;
+        void flatten(BuildNode* node, size_t depth);
+        void traverse(const Ray& ray, uint32_t node, float a, float b, Hit& hit, float& min);
+        bool traverseAny(const Ray& ray, uint32_t node, float a, float b, float tmax);
 
     public:
-        KDTree(vector<Primitive*>* list);
-        void insert(Primitive* obj);
-        Hit intersect(glm::vec3 origin, glm::vec3 direction);
+        KDTree() = default;
+        KDTree(vector<Primitive*>* list, SplitMethod method = MIDPOINT, ThreadPool* pool = nullptr);
+        virtual TreeStats getStats() override;
+        virtual Hit intersect(const Ray& ray, float tmax = INFINITY) override;
+        virtual bool occluded(const Ray& ray, float tmax) override;
+        virtual void intersectPacket(const Ray* rays, int count, Hit* hits) override;
+        virtual void occludedPacket(const Ray* rays, const float* tmax, int count, bool* blocked) override;
+        virtual bool save(CacheWriter& out, vector<Primitive*>* list) override;
+        virtual bool load(CacheReader& in, vector<Primitive*>* list) override;
         
-};
\ No newline at end of file
+};
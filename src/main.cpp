@@ -1,5 +1,4 @@
-#include <fstream>
-#include <ctime>
+#include <chrono>
 //temp
 #include <iostream>
 
@@ -13,10 +12,19 @@
 #include "material.h"
 #include "texture.h"
 #include "light.h"
+#include "instance.h"
+#include "session.h"
+#include "image.h"
+#include "bench.h"
 
 using namespace std;
 
-int main() {
+int main(int argc, char** argv) {
+
+    // timing mode
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        return benchmark(argc > 2 ? argv[2] : "resources/bun_zipper.ply");
+    }
 
     // output properties
     const int HEIGHT = 800;
@@ -63,34 +71,50 @@ int main() {
     // // bunny->read("resources/box.ply");
     // scene.add(*bunny);
     // scene.add(*light);
+    // scene.setSplitMethod(SAH);
+
+    // ALT SCENE (instancing test)
+    // Scene scene = Scene(glm::vec3(1, 1, .75f));
+    // Light *light = new Light(glm::vec3(5, -1, 10), glm::vec3(1), 1);
+    // Phong *phong = new Phong(glm::vec3(.5f, .5f, 1), glm::vec3(1), 10.0f);
+    // Mesh *bunny = new Mesh(glm::vec3(0), glm::vec3(0), glm::vec3(30), phong);
+    // bunny->read("resources/bun_zipper.ply");
+    // // bunny->load("resources/bun_zipper.ply", "resources", ACCEL_KD, MIDPOINT);
+    // for (int i = 0; i < 12; i++) {
+    //     Instance *copy = new Instance(bunny, glm::vec3(-2 - i, -3 + 1.5f * (i % 5), -3), glm::vec3(glm::radians(90.0f), glm::radians(30.0f * i), 0), glm::vec3(0.7f));
+    //     scene.add(*copy);
+    // }
+    // scene.add(*light);
 
     // set up camera
-    Camera camera = Camera(glm::vec3(10, 0, 2.5), glm::vec3(-1, 0, -glm::tan(glm::radians(5.0f))), glm::vec3(0, 0, 1));
+    Camera camera = Camera(glm::vec3(20, 0, 5), glm::vec3(9, 0, 2.5f - glm::tan(glm::radians(5.0f))), glm::vec3(0, 0, 1));
+    // camera.setSampling(1, 16, 0.05f);
+    // Camera camera = Camera(glm::vec3(20, 0, 5), glm::vec3(9, 0, 2.5f - glm::tan(glm::radians(5.0f))), glm::vec3(0, 0, 1), new LocalReinhardModel());
 
     // start clock
-    std::clock_t start = std::clock();
+    auto start = std::chrono::steady_clock::now();
 
-    // render
-    glm::vec3 *frame = camera.render(HEIGHT, WIDTH, scene);
+    // prepare the scene once, then render
+    RenderSession session(scene);
+    glm::vec3 *frame = session.render(camera, HEIGHT, WIDTH);
+
+    // frames too large to hold can instead be streamed to the file
+    // ImageWriter *writer = createImageWriter(FILENAME);
+    // writer->open(FILENAME, HEIGHT, WIDTH);
+    // session.render(camera, HEIGHT, WIDTH, *writer);
+    // writer->close();
 
     // report render time
-    double duration = std::difftime(std::clock(), start) / (double) CLOCKS_PER_SEC;
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     cout << "finished rendering after " << duration << " seconds." << endl;
 
-    // save to ppm
-    ofstream file;
-    file.open(FILENAME);
-    file << "P3 " << WIDTH << " " << HEIGHT << " 255" << endl;
-
-    // write discrete pixel value
-    glm::ivec3 pixel;
-    for (int i = 0; i < HEIGHT * WIDTH; i++) {
-        pixel = glm::floor(255.0f * glm::clamp(frame[i] / MAX_DISP_LUM, 0.0f, 1.0f));
-        file << pixel.x << " " << pixel.y << " " << pixel.z << "\n";
+    // save as ppm, or pfm or qoi by extension
+    if (writeImage(FILENAME, frame, HEIGHT, WIDTH)) {
+        cout << "saved to " << FILENAME << "." << endl;
+    } else {
+        cout << "failed to write " << FILENAME << "." << endl;
     }
 
-    cout << "saved to " << FILENAME << "." << endl;
     delete[] frame;
-    file.close();
 
 }
\ No newline at end of file
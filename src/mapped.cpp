@@ -0,0 +1,99 @@
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped.h"
+
+/**
+ * Open a file for reading. Empty and missing files are not opened.
+ * @param filename file to open
+ * @param sequential true if the file will be read once front to back, so
+ *        the kernel can read ahead
+ */
+MappedFile::MappedFile(std::string filename, bool sequential) {
+
+#if defined(__unix__) || defined(__APPLE__)
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    void* view = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (view == MAP_FAILED) {
+        return;
+    }
+
+    if (sequential) {
+        madvise(view, info.st_size, MADV_SEQUENTIAL);
+    }
+
+    data = (const char*) view;
+    size = info.st_size;
+    mapped = true;
+
+#else
+
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file || file.tellg() <= 0) {
+        return;
+    }
+
+    buffer.resize(file.tellg());
+    file.seekg(0);
+    if (!file.read(buffer.data(), buffer.size())) {
+        buffer.clear();
+        return;
+    }
+
+    data = buffer.data();
+    size = buffer.size();
+
+#endif
+
+}
+
+/**
+ * Unmap the file.
+ */
+MappedFile::~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (mapped) {
+        munmap((void*) data, size);
+    }
+#endif
+}
+
+/**
+ * @return true if the file was opened
+ */
+bool MappedFile::isOpen() {
+    return data != nullptr;
+}
+
+/**
+ * @return start of the file's contents
+ */
+const char* MappedFile::getData() {
+    return data;
+}
+
+/**
+ * @return length of the file in bytes
+ */
+size_t MappedFile::getSize() {
+    return size;
+}
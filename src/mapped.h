@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using std::vector;
+
+/**
+ * Read-only view of a whole file. The file is mapped into memory where the
+ * platform allows, so pages are only read when touched, and is otherwise
+ * read into a buffer.
+ */
+class MappedFile {
+
+    private:
+        const char* data = nullptr;
+        size_t size = 0;
+        bool mapped = false;
+        vector<char> buffer;
+
+    public:
+        MappedFile(std::string filename, bool sequential = true);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        bool isOpen();
+        const char* getData();
+        size_t getSize();
+
+};
@@ -9,38 +9,30 @@
 #include "object.h"
 #include "material.h"
 #include "light.h"
-
-// OBJECT
-
-glm::vec3 Object::getPosition() {
-    return position;
-}
-
-BoundingBox& Object::getBounds() {
-    return bound;
-}
-
-glm::vec3 Object::inverseTransform(glm::vec3 p) {
-    return invWorldMatrix * glm::vec4(p, 1);
-}
-
-void Object::transform(glm::mat4 m) {
-    position = m * glm::vec4(position, 1);
-    invWorldMatrix =  invWorldMatrix * glm::inverse(m);
-    setBounds();
-}
+#include "accel.h"
+#include "instance.h"
+#include "ply.h"
+#include "cache.h"
 
 // PRIMITIVE
 
-glm::vec3 Primitive::getColor(glm::vec3 point, glm::vec3 origin, glm::vec3 direction, Scene& scene, int depth) {
+glm::vec3 Primitive::getColor(glm::vec3 point, glm::vec3 origin, glm::vec3 direction, Scene& scene, int depth, Instance* instance) {
 
     glm::vec3 color = glm::vec3(0);
 
-    glm::vec3 n = getNormal(point);
+    // instanced primitives are stored in their mesh's space
+    glm::vec3 local = (instance == nullptr) ? point : instance->toObjectSpace(point);
+
+    Material* material = getMaterial();
+    glm::vec3 n = getNormal(local);
     glm::vec3 v = glm::normalize(-direction);
     glm::vec3 s;
     glm::vec3 r;
-    glm::vec3 objPoint = inverseTransform(point);
+    glm::vec3 objPoint = inverseTransform(local);
+
+    if (instance != nullptr) {
+        n = instance->toWorldNormal(n);
+    }
 
     vector<Light*> lights = scene.getLights();
 
@@ -49,17 +41,13 @@ glm::vec3 Primitive::getColor(glm::vec3 point, glm::vec3 origin, glm::vec3 direc
 
         glm::vec3 s = glm::normalize((*i)->getPosition() - point);
 
-        // cast shadow vector
-        Hit shadow = scene.cast(point + D_N * n, s);
+        // cast shadow segment to light
         float dist = glm::length((*i)->getPosition() - point);
+        float transmittance = scene.getTransmittance(point + D_N * n, s, dist);
 
-        // TODO: encapsulation
-        if (shadow.object != nullptr && shadow.object->material->getTransmittance() > 0.0f) {
-            glm::vec3 r = glm::reflect(-s, n);
-            color += shadow.object->material->getTransmittance() * material->getColor(objPoint, n, s, r, v, **i);
-        } else if (shadow.object == nullptr || dist < glm::length (shadow.point - point)) { 
+        if (transmittance > 0.0f) {
             glm::vec3 r = glm::reflect(-s, n);
-            color += material->getColor(objPoint, n, s, r, v, **i);
+            color += transmittance * material->getColor(objPoint, n, s, r, v, **i);
         }
 
         // recursive call
@@ -107,13 +95,23 @@ glm::vec3 Primitive::getColor(glm::vec3 point, glm::vec3 origin, glm::vec3 direc
 
 }
 
+/**
+ * @return new list holding only this primitive, owned by the caller
+ */
 vector<Primitive*>* Primitive::getPrimitives() {
-    // TODO: memory management
     auto v = new vector<Primitive*>();
     v->push_back(this);
     return v;
 }
 
+/**
+ * @return object the primitive is a surface of, itself unless it is part
+ *         of a larger object
+ */
+Object* Primitive::getOwner() {
+    return this;
+}
+
 // SPHERE
 
 Sphere::Sphere(glm::vec3 position, float radius, Material *material) {
@@ -123,6 +121,32 @@ Sphere::Sphere(glm::vec3 position, float radius, Material *material) {
     setBounds();
 }
 
+float Sphere::getRadius() {
+    return radius;
+}
+
+glm::vec3 Sphere::getPosition() {
+    return position;
+}
+
+BoundingBox Sphere::getBounds() {
+    return bound;
+}
+
+Material* Sphere::getMaterial() {
+    return material;
+}
+
+glm::vec3 Sphere::inverseTransform(glm::vec3 p) {
+    return invWorldMatrix * glm::vec4(p, 1);
+}
+
+void Sphere::transform(glm::mat4 m) {
+    position = m * glm::vec4(position, 1);
+    invWorldMatrix =  invWorldMatrix * glm::inverse(m);
+    setBounds();
+}
+
 float Sphere::intersect(glm::vec3 origin, glm::vec3 direction) {
     
     glm::vec3 dist = origin - position;
@@ -171,30 +195,58 @@ void Sphere::setBounds() {
 // TRIANGLE
 
 /**
- * Construct a triangle from 3 points, specified counterclockwise.
+ * Construct a triangle referring to a face of a mesh.
  */
-Triangle::Triangle(glm::vec3 a, glm::vec3 b, glm::vec3 c, Material *material) {
-    this->a = a;
-    this->b = b;
-    this->c = c;
-    this->position = (a + b + c) / 3.0f;
-    this->material = material;
-    setBounds();
+Triangle::Triangle(Mesh* mesh, uint32_t face) {
+    this->mesh = mesh;
+    this->face = face;
+}
+
+/**
+ * @return corner 0, 1 or 2 of the triangle
+ */
+glm::vec3 Triangle::getVertex(int i) {
+    return mesh->getVertex(face, i);
+}
+
+/**
+ * @return centroid of the triangle
+ */
+glm::vec3 Triangle::getPosition() {
+    return (getVertex(0) + getVertex(1) + getVertex(2)) / 3.0f;
+}
+
+/**
+ * Calculate axis aligned bounding box.
+ */
+BoundingBox Triangle::getBounds() {
+    return BoundingBox({ getVertex(0), getVertex(1), getVertex(2) });
+}
+
+Material* Triangle::getMaterial() {
+    return mesh->getMaterial();
+}
+
+glm::vec3 Triangle::inverseTransform(glm::vec3 p) {
+    return mesh->inverseTransform(p);
 }
 
 void Triangle::transform(glm::mat4 m) {
-    a = m * glm::vec4(a, 1);
-    b = m * glm::vec4(b, 1);
-    c = m * glm::vec4(c, 1);
-    position = (a + b + c) / 3.0f;
-    invWorldMatrix =  invWorldMatrix * glm::inverse(m);
-    setBounds();
+    // vertices are shared, so only the mesh can move them
+}
+
+/**
+ * @return mesh the triangle is a face of
+ */
+Object* Triangle::getOwner() {
+    return mesh;
 }
 
 float Triangle::intersect(glm::vec3 origin, glm::vec3 direction) {
 
-    glm::vec3 e1 = b - a;
-    glm::vec3 e2 = c - a;
+    glm::vec3 a = getVertex(0);
+    glm::vec3 e1 = getVertex(1) - a;
+    glm::vec3 e2 = getVertex(2) - a;
     glm::vec3 t = origin - a;
     glm::vec3 p = glm::cross(direction, e2);
     glm::vec3 q = glm::cross(t, e1);
@@ -217,7 +269,7 @@ float Triangle::intersect(glm::vec3 origin, glm::vec3 direction) {
 
 bool Triangle::intersect(BoundingBox& bounds) {
     // use aabb intersection
-    return this->bound.intersect(bounds);
+    return getBounds().intersect(bounds);
 }
 
 /**
@@ -226,14 +278,8 @@ bool Triangle::intersect(BoundingBox& bounds) {
  * @return normal vector
  */
 glm::vec3 Triangle::getNormal(glm::vec3 point) {
-    return glm::normalize(glm::cross(a - b, a - c));
-}
-
-/**
- * Calculate axis aligned bounding box.
- */
-void Triangle::setBounds() {
-    bound = BoundingBox({a, b, c});
+    glm::vec3 a = getVertex(0);
+    return glm::normalize(glm::cross(a - getVertex(1), a - getVertex(2)));
 }
 
 // MESH
@@ -246,7 +292,6 @@ Mesh::Mesh(glm::vec3 position, glm::vec3 rotation, glm::vec3 scale, Material* ma
     this->rotation = rotation;
     this->scale = scale;
     this->material = material;
-    this->components = vector<Primitive*>();
     setBounds();
 }
 
@@ -254,31 +299,78 @@ void Mesh::setBounds() {
     
     bound = BoundingBox();
 
-    for (auto it = components.begin(); it != components.end(); it++) {
-        bound.expand((*it)->getBounds());
+    for (auto it = vertices.begin(); it != vertices.end(); it++) {
+        bound.expand(*it);
     }
 
 }
 
+glm::vec3 Mesh::getPosition() {
+    return position;
+}
+
+BoundingBox Mesh::getBounds() {
+    return bound;
+}
+
+Material* Mesh::getMaterial() {
+    return material;
+}
+
+glm::vec3 Mesh::inverseTransform(glm::vec3 p) {
+    return invWorldMatrix * glm::vec4(p, 1);
+}
+
+/**
+ * @param face index of face
+ * @param i corner 0, 1 or 2
+ * @return position of a face's corner
+ */
+glm::vec3 Mesh::getVertex(uint32_t face, int i) {
+    return vertices[indices[3 * face + i]];
+}
+
+/**
+ * @return memory used by vertices, indices and faces
+ */
+size_t Mesh::getBytes() {
+    return vertices.size() * sizeof(glm::vec3) + indices.size() * sizeof(uint32_t)
+         + faces.size() * sizeof(Triangle) + components.size() * sizeof(Primitive*);
+}
+
 void Mesh::transform(glm::mat4 m) {
 
-    for (auto it = components.begin(); it != components.end(); it++) {
-        (*it)->transform(m);
+    for (auto it = vertices.begin(); it != vertices.end(); it++) {
+        *it = m * glm::vec4(*it, 1);
     }
 
     position = m * glm::vec4(position, 1);
     rotation = m * glm::vec4(rotation, 1);
     invWorldMatrix =  invWorldMatrix * glm::inverse(m);
-    setBounds(); // TODO: optimize
+    setBounds();
 
 }
 
 vector<Primitive*>* Mesh::getPrimitives() {
 
-    glm::mat4 m = getObjectTransform();
-    
-    for (auto it = components.begin(); it != components.end(); it++) {
-        (*it)->transform(m);
+    // apply the object transform once, however many times this is called
+    if (!placed) {
+
+        glm::mat4 m = getObjectTransform(position, rotation, scale);
+
+        for (auto it = vertices.begin(); it != vertices.end(); it++) {
+            *it = m * glm::vec4(*it, 1);
+        }
+        invWorldMatrix = invWorldMatrix * glm::inverse(m);
+        placed = true;
+        setBounds();
+
+    }
+
+    // faces may have moved since the last call
+    components.resize(faces.size());
+    for (size_t i = 0; i < faces.size(); i++) {
+        components[i] = &faces[i];
     }
 
     return &components;
@@ -286,9 +378,29 @@ vector<Primitive*>* Mesh::getPrimitives() {
 }
 
 /**
- * Returns a transform matrix based on the current position and rotation.
+ * Build an acceleration structure over the mesh in its own space, for
+ * instancing. Later calls reuse the first structure.
+ * @param type backend to build
+ * @param method split plane strategy, for k-d trees
+ * @param pool threads to build on, or null to build serially
  */
-glm::mat4 Mesh::getObjectTransform() {
+void Mesh::build(AccelType type, SplitMethod method, ThreadPool* pool) {
+    if (accel == nullptr) {
+        accel = createAccelerator(type, method, getPrimitives(), pool);
+    }
+}
+
+/**
+ * @return structure built by build, or null
+ */
+Accelerator* Mesh::getAccelerator() {
+    return accel;
+}
+
+/**
+ * Returns a transform matrix based on a position, rotation and scale.
+ */
+glm::mat4 Mesh::getObjectTransform(glm::vec3 position, glm::vec3 rotation, glm::vec3 scale) {
 
     glm::mat4 trans = glm::mat4(1);
     trans = glm::translate(trans, position);
@@ -308,21 +420,60 @@ glm::mat4 Mesh::getObjectTransform() {
  * @param c third point
  */
 void Mesh::add(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
-    
-    // add component to list
-    Triangle* tri = new Triangle(a, b, c, material);
-    components.push_back(tri);
+
+    uint32_t first = vertices.size();
+    vertices.push_back(a);
+    vertices.push_back(b);
+    vertices.push_back(c);
+    indices.push_back(first);
+    indices.push_back(first + 1);
+    indices.push_back(first + 2);
+    faces.push_back(Triangle(this, faces.size()));
 
     // expand bounding box
-    bound.expand(tri->getBounds());
-    
+    bound.expand(a);
+    bound.expand(b);
+    bound.expand(c);
+
 }
 
 /**
  * Read triangles from a PLY file into a mesh.
+ * @param filename file to read
  */
 void Mesh::read(std::string filename) {
 
+    size_t firstVertex = this->vertices.size();
+    size_t firstIndex = indices.size();
+
+    // binary triangle meshes are copied straight from the mapped file
+    if (!readMappedPLY(filename, this->vertices, indices)) {
+        readPLY(filename);
+    }
+
+    size_t numVertices = this->vertices.size() - firstVertex;
+    size_t numTriangles = (indices.size() - firstIndex) / 3;
+
+    for (size_t i = firstVertex; i < this->vertices.size(); i++) {
+        bound.expand(this->vertices[i]);
+    }
+
+    for (size_t i = 0; i < numTriangles; i++) {
+        faces.push_back(Triangle(this, faces.size()));
+    }
+
+    std::cout << "read data from " << filename << " (" << numVertices << " vertices, " << numTriangles
+              << " faces, " << getBytes() / 1024 << " KB)." << endl;
+
+}
+
+/**
+ * Read a PLY file of any format through miniply, appending its vertices and
+ * triangles to the mesh buffers.
+ * @param filename file to read
+ */
+void Mesh::readPLY(std::string filename) {
+
     miniply::PLYReader reader = miniply::PLYReader(filename.c_str());
     
     if (!reader.valid()) {
@@ -366,15 +517,14 @@ void Mesh::read(std::string filename) {
         reader.extract_properties(triProps, 3, miniply::PLYPropertyType::Int, triangles);
     }
 
-    // add triangles to mesh
-    int aIdx, bIdx, cIdx;
-    for (size_t i = 0; i < numTriangles; i++) {
-        aIdx = triangles[3 * i];
-        bIdx = triangles[3 * i + 1];
-        cIdx = triangles[3 * i + 2];
-        add(glm::vec3(vertices[3 * aIdx], vertices[3 * aIdx + 1], vertices[3 * aIdx + 2]),
-            glm::vec3(vertices[3 * bIdx], vertices[3 * bIdx + 1], vertices[3 * bIdx + 2]),
-            glm::vec3(vertices[3 * cIdx], vertices[3 * cIdx + 1], vertices[3 * cIdx + 2]));
+    // append to shared buffers, offsetting indices past existing vertices
+    uint32_t offset = this->vertices.size();
+    for (size_t i = 0; i < numVertices; i++) {
+        this->vertices.push_back(glm::vec3(vertices[3 * i], vertices[3 * i + 1], vertices[3 * i + 2]));
+    }
+
+    for (size_t i = 0; i < numTriangles * 3; i++) {
+        indices.push_back(offset + triangles[i]);
     }
 
     delete[] vertices;
@@ -382,6 +532,80 @@ void Mesh::read(std::string filename) {
     delete[] vertexProps;
     delete[] triProps;
 
-    std::cout << "read data from " << filename << "." << endl;
+}
+
+/**
+ * Read triangles from a PLY file and build the mesh's acceleration
+ * structure, reusing the placed buffers and structure saved by an earlier
+ * run when the file, the mesh's contents and placement, and the build
+ * settings all match. Call before the mesh is placed or used.
+ * @param filename file to read
+ * @param directory existing directory to keep cache files in
+ * @param type backend to build
+ * @param method split plane strategy, for k-d trees
+ * @param pool threads to build on, or null to build serially
+ */
+void Mesh::load(std::string filename, std::string directory, AccelType type, SplitMethod method, ThreadPool* pool) {
+
+    uint64_t key;
+    {
+        MappedFile source(filename);
+        key = hashBytes(source.getData(), source.getSize());
+    }
+
+    glm::vec3 placement[] = { position, rotation, scale };
+    int settings[] = { type, method };
+    key = hashBytes(vertices.data(), vertices.size() * sizeof(glm::vec3), key);
+    key = hashBytes(indices.data(), indices.size() * sizeof(uint32_t), key);
+    key = hashBytes(placement, sizeof(placement), key);
+    key = hashBytes(settings, sizeof(settings), key);
+
+    std::string path = getCachePath(directory, key);
+
+    // read into temporaries so a damaged file leaves the mesh untouched
+    vector<glm::vec3> cachedVertices;
+    vector<uint32_t> cachedIndices;
+    CacheReader in(path, key);
+    bool hit = in.readArray(cachedVertices) && in.readArray(cachedIndices) && cachedIndices.size() % 3 == 0;
+    for (auto it = cachedIndices.begin(); hit && it != cachedIndices.end(); it++) {
+        hit = *it < cachedVertices.size();
+    }
+
+    if (hit) {
+
+        // stored vertices already have the object transform applied
+        vertices.swap(cachedVertices);
+        indices.swap(cachedIndices);
+        faces.clear();
+        faces.reserve(indices.size() / 3);
+        for (size_t i = 0; i < indices.size() / 3; i++) {
+            faces.push_back(Triangle(this, i));
+        }
+        invWorldMatrix = invWorldMatrix * glm::inverse(getObjectTransform(position, rotation, scale));
+        placed = true;
+        setBounds();
+
+        accel = loadAccelerator(type, getPrimitives(), in);
+        if (accel != nullptr) {
+            std::cout << "read data from " << path << " (" << vertices.size() << " vertices, " << faces.size()
+                      << " faces, " << getName(type) << ")." << endl;
+            return;
+        }
+
+    } else {
+        read(filename);
+    }
+
+    build(type, method, pool);
+
+    CacheWriter out(path, key);
+    out.writeArray(vertices);
+    out.writeArray(indices);
+
+    if (out.isOpen() && accel->save(out, &components) && out.close()) {
+        std::cout << "saved to " << path << "." << endl;
+    } else {
+        std::cout << "failed to write " << path << "." << endl;
+    }
 
 }
\ No newline at end of file
@@ -1,15 +1,21 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <glm/vec3.hpp>
 #include <glm/mat4x4.hpp>
 
 #include "bounding.h"
+#include "scene.h"
 
+class Accelerator;
+class Instance;
+class ThreadPool;
 class Material;
 class Scene;
 class Primitive;
+class Mesh;
 
 // for floating point equality cutoffs
 #define EPSILON 0.00001f
@@ -21,22 +27,17 @@ class Primitive;
 #define MAX_DEPTH 5
 
 /**
- * Abstract object class.
+ * Abstract object class. Objects own their placement, so that primitives
+ * sharing a mesh can derive it from the mesh instead of storing a copy.
  */
 class Object {
 
-    protected:
-        glm::vec3 position;
-        BoundingBox bound;
-        Material *material;
-        glm::mat4 invWorldMatrix = glm::mat4(1);
-        virtual void setBounds() = 0;
-
     public:
-        glm::vec3 getPosition();
-        BoundingBox& getBounds();
-        glm::vec3 inverseTransform(glm::vec3 p);
-        virtual void transform(glm::mat4 m);
+        virtual glm::vec3 getPosition() = 0;
+        virtual BoundingBox getBounds() = 0;
+        virtual Material* getMaterial() = 0;
+        virtual glm::vec3 inverseTransform(glm::vec3 p) = 0;
+        virtual void transform(glm::mat4 m) = 0;
         virtual vector<Primitive*>* getPrimitives() = 0;
 
 };
@@ -50,22 +51,33 @@ class Primitive : public Object {
         virtual float intersect(glm::vec3 origin, glm::vec3 direction) = 0;
         virtual bool intersect(BoundingBox& bounds) = 0;
         virtual glm::vec3 getNormal(glm::vec3 point) = 0;
-        glm::vec3 getColor(glm::vec3 point, glm::vec3 origin, glm::vec3 direction, Scene& scene, int depth);
+        glm::vec3 getColor(glm::vec3 point, glm::vec3 origin, glm::vec3 direction, Scene& scene, int depth, Instance* instance = nullptr);
         virtual vector<Primitive*>* getPrimitives() override;
+        virtual Object* getOwner();
 
 };
 
 /**
  * Sphere primitive.
  */
-class Sphere : public Primitive {
+class Sphere final : public Primitive {
 
     private:
+        glm::vec3 position;
         float radius;
-        virtual void setBounds() override;
+        BoundingBox bound;
+        Material *material;
+        glm::mat4 invWorldMatrix = glm::mat4(1);
+        void setBounds();
     
     public:
         Sphere(glm::vec3 position, float radius, Material *material);
+        float getRadius();
+        virtual glm::vec3 getPosition() override;
+        virtual BoundingBox getBounds() override;
+        virtual Material* getMaterial() override;
+        virtual glm::vec3 inverseTransform(glm::vec3 p) override;
+        virtual void transform(glm::mat4 m) override;
         float intersect(glm::vec3 origin, glm::vec3 direction) override;
         virtual bool intersect(BoundingBox& bounds) override;
         virtual glm::vec3 getNormal(glm::vec3 point) override;
@@ -73,42 +85,67 @@ class Sphere : public Primitive {
 };
 
 /**
- * Triangle primitive.
+ * Triangle primitive. Corners, material and placement all come from the
+ * mesh, so a triangle is only a face index.
  */
-class Triangle : public Primitive {
+class Triangle final : public Primitive {
 
     private:
-        glm::vec3 a;
-        glm::vec3 b;
-        glm::vec3 c;
-        virtual void setBounds() override;
+        Mesh* mesh;
+        uint32_t face;
 
     public:
-        Triangle(glm::vec3 a, glm::vec3 b, glm::vec3 c, Material *material);
+        Triangle(Mesh* mesh, uint32_t face);
+        glm::vec3 getVertex(int i);
+        virtual glm::vec3 getPosition() override;
+        virtual BoundingBox getBounds() override;
+        virtual Material* getMaterial() override;
+        virtual glm::vec3 inverseTransform(glm::vec3 p) override;
         void transform(glm::mat4 m) override;
         float intersect(glm::vec3 origin, glm::vec3 direction) override;
         virtual bool intersect(BoundingBox& bounds) override;
         virtual glm::vec3 getNormal(glm::vec3 point) override;
+        virtual Object* getOwner() override;
 
 };
 
 /**
- * Composite object made of a collection of triangles.
+ * Composite object made of a collection of triangles, stored as one shared
+ * vertex buffer and three vertex indices per face.
  */
 class Mesh : public Object {
 
     private:
+        glm::vec3 position;
         glm::vec3 rotation;
         glm::vec3 scale;
+        BoundingBox bound;
+        Material *material;
+        glm::mat4 invWorldMatrix = glm::mat4(1);
+        vector<glm::vec3> vertices;
+        vector<uint32_t> indices;
+        vector<Triangle> faces;
         vector<Primitive*> components;
-        virtual void setBounds() override;
-        glm::mat4 getObjectTransform();
+        bool placed = false;
+        Accelerator* accel = nullptr;
+        void setBounds();
+        void readPLY(std::string filename);
 
     public:
         Mesh(glm::vec3 position, glm::vec3 rotation, glm::vec3 scale, Material* material);
+        virtual glm::vec3 getPosition() override;
+        virtual BoundingBox getBounds() override;
+        virtual Material* getMaterial() override;
+        virtual glm::vec3 inverseTransform(glm::vec3 p) override;
         virtual void transform(glm::mat4 m) override;
         virtual vector<Primitive*>* getPrimitives() override;
+        glm::vec3 getVertex(uint32_t face, int i);
+        size_t getBytes();
+        void build(AccelType type, SplitMethod method, ThreadPool* pool);
+        Accelerator* getAccelerator();
+        static glm::mat4 getObjectTransform(glm::vec3 position, glm::vec3 rotation, glm::vec3 scale);
         void add(glm::vec3 a, glm::vec3 b, glm::vec3 c);
         void read(std::string filename);
+        void load(std::string filename, std::string directory, AccelType type, SplitMethod method, ThreadPool* pool = nullptr);
 
 };
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+
+#include "ply.h"
+#include "mapped.h"
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "vertex positions must be tightly packed");
+
+/**
+ * Property of a PLY element. Lists store the size of their length prefix.
+ */
+typedef struct PLYProperty {
+    std::string name;
+    std::string type;
+    size_t size;        // bytes of a scalar, or of each list item
+    size_t countSize;   // bytes of a list's length prefix, 0 for scalars
+} PLYProperty;
+
+typedef struct PLYElementInfo {
+    std::string name;
+    size_t count;
+    vector<PLYProperty> properties;
+} PLYElementInfo;
+
+/**
+ * @return true if rows of a size fit in the bytes left, checked without
+ *         overflowing for any row count a header may claim
+ */
+static bool fits(size_t count, size_t size, size_t available) {
+    return size == 0 || count <= available / size;
+}
+
+/**
+ * @return bytes taken by a PLY scalar type, or 0 if unknown
+ */
+static size_t getTypeSize(const std::string& type) {
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") {
+        return 1;
+    } else if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") {
+        return 2;
+    } else if (type == "int" || type == "uint" || type == "int32" || type == "uint32" || type == "float" || type == "float32") {
+        return 4;
+    } else if (type == "double" || type == "float64") {
+        return 8;
+    }
+    return 0;
+}
+
+/**
+ * Read the element layout from a binary little-endian PLY header.
+ * @param header header text, up to and including the end_header line
+ * @param elements output elements, in file order
+ * @return false if the file is not binary little-endian or the header is malformed
+ */
+static bool readHeader(const std::string& header, vector<PLYElementInfo>& elements) {
+
+    std::istringstream lines(header);
+    std::string line;
+
+    if (!std::getline(lines, line) || line != "ply") {
+        return false;
+    }
+
+    bool binary = false;
+
+    while (std::getline(lines, line)) {
+
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+
+        if (keyword == "format") {
+            std::string format;
+            words >> format;
+            binary = (format == "binary_little_endian");
+        } else if (keyword == "element") {
+            PLYElementInfo element;
+            if (!(words >> element.name >> element.count)) {
+                return false;
+            }
+            elements.push_back(element);
+        } else if (keyword == "property") {
+            PLYProperty property;
+            if (elements.empty() || !(words >> property.type)) {
+                return false;
+            }
+            if (property.type == "list") {
+                std::string countType;
+                words >> countType >> property.type;
+                property.countSize = getTypeSize(countType);
+                if (property.countSize == 0) {
+                    return false;
+                }
+            } else {
+                property.countSize = 0;
+            }
+            property.size = getTypeSize(property.type);
+            if (property.size == 0 || !(words >> property.name)) {
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        } else if (keyword == "end_header") {
+            return binary;
+        }
+
+    }
+
+    return false;
+
+}
+
+/**
+ * Copy vertex positions and triangle indices out of a mapped binary PLY.
+ * @param data start of the file
+ * @param size length of the file in bytes
+ * @param vertices vertex buffer to append to
+ * @param indices index buffer to append to, offset past existing vertices
+ * @return false if the layout is not handled or the file is truncated
+ */
+static bool readBody(const char* data, size_t size, vector<glm::vec3>& vertices, vector<uint32_t>& indices) {
+
+    // header is text ending at the first end_header line
+    const char marker[] = "end_header\n";
+    const char* headerEnd = std::search(data, data + size, marker, marker + sizeof(marker) - 1);
+    if (headerEnd == data + size) {
+        return false;
+    }
+    headerEnd += sizeof(marker) - 1;
+
+    vector<PLYElementInfo> elements;
+    if (!readHeader(std::string(data, headerEnd), elements)) {
+        return false;
+    }
+
+    const char* p = headerEnd;
+    const char* limit = data + size;
+    uint32_t offset = vertices.size();
+    size_t numVertices = 0;
+    bool haveVertices = false;
+    bool haveFaces = false;
+
+    for (auto element = elements.begin(); element != elements.end(); element++) {
+
+        // fixed-size rows, each property at a known offset
+        size_t stride = 0;
+        int x = -1, y = -1, z = -1;
+        bool list = false;
+
+        for (auto property = element->properties.begin(); property != element->properties.end(); property++) {
+            bool isFloat = property->countSize == 0 && property->size == 4 && property->type.compare(0, 5, "float") == 0;
+            if (isFloat && property->name == "x") { x = stride; }
+            if (isFloat && property->name == "y") { y = stride; }
+            if (isFloat && property->name == "z") { z = stride; }
+            list |= property->countSize > 0;
+            stride += property->size;
+        }
+
+        if (list) {
+
+            // only faces given as a single list of 32-bit indices
+            PLYProperty& property = element->properties[0];
+            if (element->name != "face" || element->properties.size() != 1 || property.size != 4 || !haveVertices) {
+                return false;
+            }
+
+            // a damaged count must not size the buffer beyond what the file holds
+            if (!fits(element->count, property.countSize + 3 * sizeof(uint32_t), limit - p)) {
+                return false;
+            }
+
+            size_t first = indices.size();
+            indices.resize(first + 3 * element->count);
+            uint32_t* out = indices.data() + first;
+
+            for (size_t i = 0; i < element->count; i++) {
+
+                if (p + property.countSize + 3 * sizeof(uint32_t) > limit) {
+                    return false;
+                }
+
+                // host is little-endian, so the low bytes hold the count
+                uint64_t count = 0;
+                std::memcpy(&count, p, property.countSize);
+                p += property.countSize;
+                if (count != 3) {
+                    return false;
+                }
+
+                std::memcpy(out, p, 3 * sizeof(uint32_t));
+                p += 3 * sizeof(uint32_t);
+
+                for (int k = 0; k < 3; k++) {
+                    if (out[k] >= numVertices) {
+                        return false;
+                    }
+                    out[k] += offset;
+                }
+                out += 3;
+
+            }
+
+            haveFaces = true;
+            continue;
+
+        }
+
+        if (!fits(element->count, stride, limit - p)) {
+            return false;
+        }
+
+        if (element->name == "vertex") {
+
+            if (x < 0 || y < 0 || z < 0 || haveVertices) {
+                return false;
+            }
+
+            numVertices = element->count;
+            vertices.resize(offset + numVertices);
+            float* out = &vertices[offset].x;
+
+            if (stride == sizeof(glm::vec3) && x == 0 && y == 4 && z == 8) {
+                // positions only, already laid out like the vertex buffer
+                std::memcpy(out, p, numVertices * stride);
+            } else {
+                for (size_t i = 0; i < numVertices; i++) {
+                    const char* row = p + i * stride;
+                    std::memcpy(out++, row + x, sizeof(float));
+                    std::memcpy(out++, row + y, sizeof(float));
+                    std::memcpy(out++, row + z, sizeof(float));
+                }
+            }
+
+            haveVertices = true;
+
+        }
+
+        p += stride * element->count;
+
+    }
+
+    return haveVertices && haveFaces;
+
+}
+
+/**
+ * Read a binary little-endian PLY of triangles by mapping the file into
+ * memory and copying positions and indices straight into mesh buffers, with
+ * no intermediate arrays. Indices are offset past the existing vertices.
+ * @param filename file to read
+ * @param vertices vertex buffer to append to
+ * @param indices index buffer to append to
+ * @return false, with the buffers unchanged, if the file could not be mapped
+ *         or is not a binary triangle mesh with float positions
+ */
+bool readMappedPLY(std::string filename, vector<glm::vec3>& vertices, vector<uint32_t>& indices) {
+
+#if (defined(__unix__) || defined(__APPLE__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+    // where files are not mapped, checking the header would read the whole file
+    MappedFile file(filename);
+    if (!file.isOpen()) {
+        return false;
+    }
+
+    size_t firstVertex = vertices.size();
+    size_t firstIndex = indices.size();
+    bool read = readBody(file.getData(), file.getSize(), vertices, indices);
+
+    if (!read) {
+        vertices.resize(firstVertex);
+        indices.resize(firstIndex);
+    }
+
+    return read;
+
+#else
+
+    return false;
+
+#endif
+
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/vec3.hpp>
+
+using std::vector;
+
+bool readMappedPLY(std::string filename, vector<glm::vec3>& vertices, vector<uint32_t>& indices);
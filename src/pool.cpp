@@ -0,0 +1,210 @@
+#include "pool.h"
+
+// identity of the calling thread within its pool
+static thread_local ThreadPool* currentPool = nullptr;
+static thread_local size_t currentIndex = 0;
+
+/**
+ * Start a pool of worker threads.
+ * @param threads number of workers, or 0 for one per hardware thread
+ */
+ThreadPool::ThreadPool(size_t threads) : queues(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())) {
+
+    pending = 0;
+    next = 0;
+
+    for (size_t i = 0; i < queues.size(); i++) {
+        workers.push_back(std::thread(&ThreadPool::work, this, i));
+    }
+
+}
+
+/**
+ * Finish all queued tasks and join the workers.
+ */
+ThreadPool::~ThreadPool() {
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    wake.notify_all();
+
+    for (auto it = workers.begin(); it != workers.end(); it++) {
+        it->join();
+    }
+
+}
+
+/**
+ * @return number of worker threads
+ */
+size_t ThreadPool::size() {
+    return workers.size();
+}
+
+/**
+ * Get the index of the calling thread, for addressing per-thread state.
+ * @return worker index in [0, size), or size() for threads outside the pool
+ */
+size_t ThreadPool::index() {
+    return (currentPool == this) ? currentIndex : size();
+}
+
+/**
+ * Queue a task. Tasks submitted from a worker go to that worker's own queue,
+ * so nested work stays local until another thread steals it.
+ * @param task function to run
+ */
+void ThreadPool::submit(std::function<void()> task) {
+
+    size_t id = index();
+
+    if (id == size()) {
+        id = next++ % size();
+    }
+
+    // count the task before queueing it, so a worker that takes it at once
+    // never decrements pending below zero
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending++;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(queues[id].lock);
+        queues[id].tasks.push_back(std::move(task));
+    }
+
+    wake.notify_one();
+
+}
+
+/**
+ * Take a task for a worker, stealing from other queues if its own is empty.
+ * @param id worker index
+ * @param task output task
+ * @return true if a task was found
+ */
+bool ThreadPool::pop(size_t id, std::function<void()>& task) {
+
+    // own queue, newest first
+    {
+        std::lock_guard<std::mutex> guard(queues[id].lock);
+        if (!queues[id].tasks.empty()) {
+            task = std::move(queues[id].tasks.back());
+            queues[id].tasks.pop_back();
+            pending--;
+            return true;
+        }
+    }
+
+    // steal oldest work from the others
+    for (size_t i = 1; i < queues.size(); i++) {
+        Queue& victim = queues[(id + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            pending--;
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+/**
+ * Run one queued task on the calling worker, if any is available.
+ * @return true if a task was run
+ */
+bool ThreadPool::runPending() {
+
+    size_t id = index();
+    std::function<void()> task;
+
+    if (id == size() || !pop(id, task)) {
+        return false;
+    }
+
+    task();
+    return true;
+
+}
+
+/**
+ * Worker thread loop.
+ * @param id worker index
+ */
+void ThreadPool::work(size_t id) {
+
+    currentPool = this;
+    currentIndex = id;
+
+    std::function<void()> task;
+
+    while (true) {
+
+        if (pop(id, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return stopping || pending > 0; });
+
+        if (stopping && pending == 0) {
+            return;
+        }
+
+    }
+
+}
+
+/**
+ * Create an empty task group.
+ * @param pool pool to run tasks on
+ */
+TaskGroup::TaskGroup(ThreadPool& pool) : pool(pool) {
+    count = 0;
+}
+
+/**
+ * Submit a task as part of this group.
+ * @param task function to run
+ */
+void TaskGroup::run(std::function<void()> task) {
+
+    count++;
+
+    pool.submit([this, task] {
+        task();
+        std::lock_guard<std::mutex> guard(lock);
+        if (--count == 0) {
+            done.notify_all();
+        }
+    });
+
+}
+
+/**
+ * Block until every task in the group has finished. Workers of the pool keep
+ * running queued tasks while they wait, so groups may be nested.
+ */
+void TaskGroup::wait() {
+
+    if (pool.index() < pool.size()) {
+        while (count > 0) {
+            if (!pool.runPending()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return count == 0; });
+
+}
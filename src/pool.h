@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::vector;
+
+/**
+ * Fixed set of worker threads, each with its own task queue. Workers pop
+ * their own queue LIFO and steal FIFO from the others when it runs dry.
+ */
+class ThreadPool {
+
+    private:
+        struct Queue {
+            std::mutex lock;
+            std::deque<std::function<void()>> tasks;
+        };
+        vector<std::thread> workers;
+        vector<Queue> queues;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::atomic<size_t> pending;
+        std::atomic<size_t> next;
+        bool stopping = false;
+        bool pop(size_t id, std::function<void()>& task);
+        void work(size_t id);
+
+    public:
+        ThreadPool(size_t threads = 0);
+        ~ThreadPool();
+        size_t size();
+        size_t index();
+        void submit(std::function<void()> task);
+        bool runPending();
+
+};
+
+/**
+ * A set of tasks submitted to a pool that can be waited on together.
+ */
+class TaskGroup {
+
+    private:
+        ThreadPool& pool;
+        std::atomic<size_t> count;
+        std::mutex lock;
+        std::condition_variable done;
+
+    public:
+        TaskGroup(ThreadPool& pool);
+        void run(std::function<void()> task);
+        void wait();
+
+};
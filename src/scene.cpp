@@ -1,12 +1,30 @@
+#include <set>
 #include <vector>
-#include <ctime>
+#include <chrono>
 #include <iostream>
 #include <glm/vec3.hpp>
 
 #include "scene.h"
-#include "kd.h"
+#include "accel.h"
 #include "object.h"
+#include "material.h"
 #include "light.h"
+#include "pool.h"
+#include "instance.h"
+
+/**
+ * Construct a ray.
+ * @param origin origin of the ray
+ * @param direction direction of the ray
+ */
+Ray::Ray(glm::vec3 origin, glm::vec3 direction) {
+    this->origin = origin;
+    this->direction = direction;
+    for (int i = 0; i < 3; i++) {
+        invDirection[i] = 1.0f / direction[i];
+        sign[i] = invDirection[i] < 0;
+    }
+}
 
 /**
  * Construct an empty scene.
@@ -19,6 +37,42 @@ Scene::Scene(glm::vec3 background) {
     this->tree = nullptr;
 }
 
+/**
+ * Free the acceleration structure, the primitive list it was built over
+ * and the instances meshes are placed through in two-level mode. Objects
+ * and lights belong to the caller.
+ */
+Scene::~Scene() {
+    release();
+    for (auto it = wrappers.begin(); it != wrappers.end(); it++) {
+        delete it->second;
+    }
+}
+
+/**
+ * Get the object that places an added object in the scene. In two-level
+ * mode each mesh is placed through an identity instance, so that it gets
+ * its own tree; the scene makes it on first use and keeps it, so moves
+ * made through it last for the scene's lifetime.
+ * @param object an object added to the scene
+ * @return the object itself or the instance placing it
+ */
+Object* Scene::getPlacement(Object* object) {
+
+    Mesh* mesh = dynamic_cast<Mesh*>(object);
+    if (!twoLevel || mesh == nullptr) {
+        return object;
+    }
+
+    Instance*& wrapper = wrappers[mesh];
+    if (wrapper == nullptr) {
+        wrapper = new Instance(mesh, glm::vec3(0), glm::vec3(0), glm::vec3(1));
+    }
+
+    return wrapper;
+
+}
+
 /**
  * Get scene lights.
  */
@@ -27,13 +81,14 @@ vector<Light*>& Scene::getLights() {
 }
 
 /**
- * Apply a transform to all objects in the scene.
+ * Apply a transform to all objects in the scene. Rendering does not need
+ * this; call refit afterwards if the tree has already been generated.
  * @param m transformation matrix
  */
 void Scene::transform(glm::mat4 m) {
 
     for (vector<Object*>::iterator i = objects.begin(); i != objects.end(); i++) {
-        (*i)->transform(m);
+        getPlacement(*i)->transform(m);
     }
 
     for (vector<Light*>::iterator i = lights.begin(); i != lights.end(); i++) {
@@ -44,7 +99,8 @@ void Scene::transform(glm::mat4 m) {
 
 /**
  * Create a list of renderable primitives from all scene objects.
- * @return pointer to primitives list
+ * @return new primitives list, owned by the caller until it is passed to
+ *         generateTree
  */
 vector<Primitive*>* Scene::getPrimitives() {
 
@@ -53,8 +109,18 @@ vector<Primitive*>* Scene::getPrimitives() {
     // iterate through scene objects, adding primitives to list
     vector<Primitive*>* obj;
     for (auto it = objects.begin(); it != objects.end(); it++) {
-        obj = (*it)->getPrimitives();
+
+        // standalone primitives are added as they are, without a list of one
+        Object* placement = getPlacement(*it);
+        Primitive* primitive = dynamic_cast<Primitive*>(placement);
+        if (primitive != nullptr) {
+            prims->push_back(primitive);
+            continue;
+        }
+
+        obj = placement->getPrimitives();
         prims->insert(prims->end(), obj->begin(), obj->end());
+
     }
 
     return prims;
@@ -62,17 +128,129 @@ vector<Primitive*>* Scene::getPrimitives() {
 }
 
 /**
- * Create K-D tree for rendering.
+ * Set the acceleration structure backend.
+ * @param type backend
  */
-void Scene::generateTree(vector<Primitive*>* prims) {
+void Scene::setAccelerator(AccelType type) {
+    this->accel = type;
+}
+
+/**
+ * Set the split plane strategy used when building the K-D tree.
+ * @param method split strategy
+ */
+void Scene::setSplitMethod(SplitMethod method) {
+    this->split = method;
+}
+
+/**
+ * Give each mesh its own acceleration structure under a top level over
+ * object bounds, so that objects can move rigidly without a full rebuild.
+ * Meshes moved while two-level are moved through their instance, which a
+ * flattened scene does not use, so switch before moving anything.
+ * @param twoLevel true to build two levels, false to flatten all primitives
+ */
+void Scene::setTwoLevel(bool twoLevel) {
+    this->twoLevel = twoLevel;
+}
+
+/**
+ * Create the acceleration structure for rendering, replacing any earlier
+ * one along with the list it was built over.
+ * @param prims primitives to build the structure over, which the scene
+ *        takes ownership of
+ * @param pool threads to build on, or null to build serially
+ */
+void Scene::generateTree(vector<Primitive*>* prims, ThreadPool* pool) {
 
     // start clock
-    std::clock_t start = std::clock();
+    auto start = std::chrono::steady_clock::now();
+
+    // shadow rays only need to march through blockers if some can be seen through
+    transparent = false;
+    for (size_t i = 0; i < prims->size(); i++) {
+        transparent |= (*prims)[i]->getMaterial()->getTransmittance() > 0.0f;
+    }
+
+    // instances share one structure per mesh, built before the level above them
+    std::set<Mesh*> meshes;
+    size_t instances = 0;
+    for (size_t i = 0; i < prims->size(); i++) {
+        Instance* instance = dynamic_cast<Instance*>((*prims)[i]);
+        if (instance != nullptr) {
+            instance->build(accel, split, pool);
+            meshes.insert(instance->getMesh());
+            instances++;
+        }
+    }
+
+    // k-d split planes depend on where objects are, so they cannot be refit
+    AccelType top = (instances > 0 && accel == ACCEL_KD) ? ACCEL_BVH : accel;
 
     // generate tree
-    tree = new KDTree(prims);
-    double duration = std::difftime(std::clock(), start) / (double) CLOCKS_PER_SEC;
-    cout << "k-d tree generated after " << duration << " seconds." << endl;
+    delete tree;
+    if (primitives != prims) {
+        delete primitives;
+        primitives = prims;
+    }
+    tree = createAccelerator(top, split, prims, pool);
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t threads = (pool == nullptr) ? 1 : pool->size();
+    cout << getName(top) << " generated after " << duration << " seconds on " << threads << " threads." << endl;
+
+    // report tree shape
+    TreeStats stats = tree->getStats();
+    cout << "  " << stats.nodes << " nodes, " << stats.leaves << " leaves, "
+         << stats.references << " primitive references, depth " << stats.depth << ", "
+         << stats.bytes / 1024 << " KB." << endl;
+    if (stats.buildBytes > 0) {
+        cout << "  " << stats.buildBytes / 1024 << " KB of build memory released." << endl;
+    }
+
+    if (instances > 0) {
+        size_t bytes = 0;
+        for (Mesh* mesh : meshes) {
+            bytes += mesh->getBytes() + mesh->getAccelerator()->getStats().bytes;
+        }
+        cout << "  " << instances << " instances of " << meshes.size() << " meshes, sharing "
+             << bytes / 1024 << " KB." << endl;
+    }
+
+}
+
+/**
+ * @return true once the acceleration structure has been generated
+ */
+bool Scene::hasTree() {
+    return tree != nullptr;
+}
+
+/**
+ * Free the acceleration structure and the primitive list it was built over.
+ */
+void Scene::release() {
+    delete tree;
+    delete primitives;
+    tree = nullptr;
+    primitives = nullptr;
+}
+
+/**
+ * Update the acceleration structure after objects have moved rigidly, by
+ * refitting the top level. Instanced meshes keep their own trees as they
+ * are; other primitives are rebuilt if the backend cannot refit. Does
+ * nothing before the tree has been generated, as there is nothing to update.
+ * @param pool threads to rebuild on, or null to rebuild serially
+ */
+void Scene::refit(ThreadPool* pool) {
+
+    if (tree == nullptr) {
+        return;
+    }
+
+    if (!tree->refit()) {
+        generateTree(primitives, pool);
+    }
 
 }
 
@@ -99,7 +277,95 @@ void Scene::add(Object &object) {
  * @return pointer to intersected object or null pointer
  */
 Hit Scene::cast(glm::vec3 origin, glm::vec3 direction) {
-    return tree->intersect(origin, direction);
+    return tree->intersect(Ray(origin, direction));
+}
+
+/**
+ * Cast a packet of coherent rays into the scene together.
+ * @param rays rays to cast
+ * @param count number of rays, at most PACKET_SIZE
+ * @param hits output nearest intersection for each ray
+ */
+void Scene::cast(const Ray* rays, int count, Hit* hits) {
+    tree->intersectPacket(rays, count, hits);
+}
+
+/**
+ * Test whether anything blocks a ray segment.
+ * @param origin origin of the ray
+ * @param direction normalized direction of the ray
+ * @param tmax length of the segment
+ * @return true if any object lies within the segment
+ */
+bool Scene::occluded(glm::vec3 origin, glm::vec3 direction, float tmax) {
+    return tree->occluded(Ray(origin, direction), tmax);
+}
+
+/**
+ * Test a packet of coherent ray segments for blockers together, such as
+ * shadow rays from neighbouring points toward one light.
+ * @param rays rays to trace
+ * @param tmax length of each segment
+ * @param count number of rays, at most PACKET_SIZE
+ * @param blocked output whether each segment is blocked
+ */
+void Scene::occluded(const Ray* rays, const float* tmax, int count, bool* blocked) {
+    tree->occludedPacket(rays, tmax, count, blocked);
+}
+
+/**
+ * Get the fraction of light passing along a ray segment. Opaque blockers stop
+ * it entirely and each transparent object passed through scales it by its
+ * transmittance. Surfaces are grouped by the object they belong to, a mesh
+ * or an instance of one, and consecutive crossings of the same object
+ * count once, so entering and leaving a closed object scales the light
+ * once. An object crossed again after another one counts again.
+ * @param origin origin of the ray
+ * @param direction normalized direction of the ray
+ * @param tmax length of the segment, usually the distance to a light
+ * @return transmittance in [0, 1]
+ */
+float Scene::getTransmittance(glm::vec3 origin, glm::vec3 direction, float tmax) {
+
+    // unblocked segments, the common case, need only an any-hit query
+    if (!occluded(origin, direction, tmax)) {
+        return 1.0f;
+    } else if (!transparent) {
+        return 0.0f;
+    }
+
+    // otherwise march through blockers nearest first
+    float transmittance = 1.0f;
+    Object* last = nullptr;
+
+    while (tmax > 0) {
+
+        Hit hit = cast(origin, direction);
+        float dist = glm::length(hit.point - origin);
+
+        if (hit.object == nullptr || dist >= tmax) {
+            break;
+        }
+
+        float t = hit.object->getMaterial()->getTransmittance();
+        if (t <= 0.0f) {
+            return 0.0f;
+        }
+
+        // instances share their mesh's primitives, so they are told apart by instance
+        Object* owner = (hit.instance != nullptr) ? hit.instance : hit.object->getOwner();
+        if (owner != last) {
+            transmittance *= t;
+            last = owner;
+        }
+
+        origin = hit.point + D_N * direction;
+        tmax -= dist + D_N;
+
+    }
+
+    return transmittance;
+
 }
 
 /**
@@ -109,13 +375,23 @@ Hit Scene::cast(glm::vec3 origin, glm::vec3 direction) {
  * @return pixel "color"
  */
 glm::vec3 Scene::getPixel(glm::vec3 origin, glm::vec3 direction, int depth) {
-    
     Hit hit = cast(origin, direction);
-    
+    return shade(hit, origin, direction, depth);
+}
+
+/**
+ * Get the illuminance arriving along a ray from its nearest intersection.
+ * @param hit nearest intersection of the ray
+ * @param origin origin of the ray
+ * @param direction direction of the ray
+ * @return pixel "color"
+ */
+glm::vec3 Scene::shade(Hit& hit, glm::vec3 origin, glm::vec3 direction, int depth) {
+
     if (hit.object == nullptr) {
         return background;
     } else {
-        return hit.object->getColor(hit.point, origin, direction, *this, depth);
+        return hit.object->getColor(hit.point, origin, direction, *this, depth, hit.instance);
     }
 
 }
\ No newline at end of file
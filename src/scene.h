@@ -1,37 +1,100 @@
 #pragma once
 
+#include <cmath>
+#include <map>
 #include <vector>
 #include <glm/mat4x4.hpp>
 
-class KDTree;
+class Accelerator;
 class Object;
 class Primitive;
+class Instance;
+class Mesh;
 class Light;
+class ThreadPool;
 
 using namespace std;
 
+/**
+ * Nearest intersection of a ray. Hits on instanced geometry name the
+ * primitive of the shared mesh and the instance it was reached through.
+ */
 typedef struct Hit {
-    Primitive *object;
+    Primitive *object = nullptr;
     glm::vec3 point;
+    float distance = INFINITY;
+    Instance *instance = nullptr;
 } Hit;
 
+/**
+ * A ray with its reciprocal direction and direction signs cached for
+ * acceleration structure traversal.
+ */
+typedef struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    glm::vec3 invDirection;
+    int sign[3];
+    Ray() = default;
+    Ray(glm::vec3 origin, glm::vec3 direction);
+} Ray;
+
+/**
+ * Strategy for choosing k-d tree split planes.
+ */
+enum SplitMethod {
+    MIDPOINT,   // halve the centroid bounds along the largest axis
+    SAH         // minimize the surface area heuristic cost
+};
+
+/**
+ * Acceleration structure backends.
+ */
+enum AccelType {
+    ACCEL_KD,   // k-d tree
+    ACCEL_BVH,  // binned SAH bounding volume hierarchy
+    ACCEL_BVH4, // 4-wide BVH with SSE box tests
+    ACCEL_BVH8  // 8-wide BVH with AVX box tests
+};
+
 class Scene {    
 
     private:
         vector<Light*> lights;
         vector<Object*> objects;
         glm::vec3 background;
-        KDTree* tree;
+        Accelerator* tree;
+        AccelType accel = ACCEL_KD;
+        SplitMethod split = MIDPOINT;
+        bool transparent = false;
+        bool twoLevel = false;
+        vector<Primitive*>* primitives = nullptr;
+        map<Mesh*, Instance*> wrappers;
+        Object* getPlacement(Object* object);
 
     public:
         Scene(glm::vec3 background);
+        ~Scene();
+        Scene(const Scene&) = delete;
+        Scene& operator=(const Scene&) = delete;
         vector<Light*>& getLights();
         vector<Primitive*>* getPrimitives();
         void transform(glm::mat4 m);
-        void generateTree(vector<Primitive*>* prims);
+        void setAccelerator(AccelType type);
+        void setSplitMethod(SplitMethod method);
+        void setTwoLevel(bool twoLevel);
+        void generateTree(vector<Primitive*>* prims, ThreadPool* pool = nullptr);
+        bool hasTree();
+        void release();
+        void refit(ThreadPool* pool = nullptr);
         void add(Light& light);
         void add(Object& object);
         Hit cast(glm::vec3 origin, glm::vec3 direction);
+        void cast(const Ray* rays, int count, Hit* hits);
+        bool occluded(glm::vec3 origin, glm::vec3 direction, float tmax);
+        void occluded(const Ray* rays, const float* tmax, int count, bool* blocked);
+        float getTransmittance(glm::vec3 origin, glm::vec3 direction, float tmax);
+        glm::vec3 shade(Hit& hit, glm::vec3 origin, glm::vec3 direction, int depth);
         glm::vec3 getPixel(glm::vec3 origin, glm::vec3 direction, int depth);
 
 };
@@ -0,0 +1,60 @@
+#include <vector>
+
+#include "session.h"
+#include "scene.h"
+#include "camera.h"
+
+/**
+ * Prepare a scene for rendering.
+ * @param scene scene to render, which must outlive the session
+ * @param threads render thread count, or 0 to use every hardware thread
+ */
+RenderSession::RenderSession(Scene& scene, size_t threads) : scene(scene), pool(threads) {
+    primitives = scene.getPrimitives();
+    scene.generateTree(primitives, &pool);
+}
+
+/**
+ * Release the scene's acceleration structure and primitive list.
+ */
+RenderSession::~RenderSession() {
+    scene.release();
+}
+
+/**
+ * Render the prepared scene.
+ * @param camera camera to render from
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @return tone mapped frame, owned by the caller
+ */
+glm::vec3* RenderSession::render(Camera& camera, size_t height, size_t width) {
+    return camera.render(height, width, scene, pool);
+}
+
+/**
+ * Render the prepared scene straight to an image, holding only a window of
+ * rows, for frames too large to keep in memory.
+ * @param camera camera to render from
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @param writer writer opened for an image of this size
+ */
+void RenderSession::render(Camera& camera, size_t height, size_t width, ImageWriter& writer) {
+    camera.render(height, width, scene, pool, writer);
+}
+
+/**
+ * Update the acceleration structure after objects have moved rigidly.
+ */
+void RenderSession::refit() {
+    scene.refit(&pool);
+}
+
+/**
+ * @return flattened scene primitives, owned by the scene until the session
+ *         ends
+ */
+vector<Primitive*>* RenderSession::getPrimitives() {
+    return primitives;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include <glm/vec3.hpp>
+
+#include "pool.h"
+
+class Camera;
+class ImageWriter;
+class Scene;
+class Primitive;
+
+using std::vector;
+
+/**
+ * A scene prepared for rendering. The session flattens the scene into
+ * primitives and builds its acceleration structure once, then renders any
+ * number of cameras or frames against them on one set of threads. The
+ * prepared state is released when the session ends.
+ */
+class RenderSession {
+
+    private:
+        Scene& scene;
+        ThreadPool pool;
+        vector<Primitive*>* primitives;
+
+    public:
+        RenderSession(Scene& scene, size_t threads = 0);
+        ~RenderSession();
+        RenderSession(const RenderSession&) = delete;
+        RenderSession& operator=(const RenderSession&) = delete;
+        glm::vec3* render(Camera& camera, size_t height, size_t width);
+        void render(Camera& camera, size_t height, size_t width, ImageWriter& writer);
+        void refit();
+        vector<Primitive*>* getPrimitives();
+
+};
@@ -1,30 +1,377 @@
-#include <glm/geometric.hpp>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 #include "tone.h"
+#include "image.h"
+#include "pool.h"
+
+using std::vector;
+
+// pixels mapped at a time on the way to quantized output
+#define TONE_BLOCK 256
+
+// photometric weights of red, green and blue
+static const glm::vec3 LUMINANCE = glm::vec3(0.27f, 0.67f, 0.06f);
+
+/**
+ * Run a task on each chunk of a range.
+ * @param size number of items, pixels or rows
+ * @param chunk items in each chunk
+ * @param pool threads to run on, or null to run on the calling thread
+ * @param task called with the index, first item and item count of a chunk
+ */
+static void forChunks(size_t size, size_t chunk, ThreadPool* pool, const std::function<void(size_t, size_t, size_t)>& task) {
+
+    size_t chunks = (size + chunk - 1) / chunk;
+
+    if (pool == nullptr || chunks < 2) {
+        for (size_t c = 0; c < chunks; c++) {
+            task(c, c * chunk, std::min(chunk, size - c * chunk));
+        }
+        return;
+    }
+
+    TaskGroup group(*pool);
+    for (size_t c = 0; c < chunks; c++) {
+        group.run([&task, c, chunk, size] {
+            task(c, c * chunk, std::min(chunk, size - c * chunk));
+        });
+    }
+    group.wait();
+
+}
+
+#ifdef __SSE2__
+
+/**
+ * Luminance of four consecutive pixels, with the same products, sums and
+ * fused steps as getLuminance so results match it exactly.
+ * @param p first channel of the first pixel
+ */
+static __m128 getLuminance4(const float* p) {
+
+    // x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+    __m128 a = _mm_loadu_ps(p);
+    __m128 b = _mm_loadu_ps(p + 4);
+    __m128 c = _mm_loadu_ps(p + 8);
+
+    __m128 xy = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2));
+    __m128 yz = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1));
+    __m128 x = _mm_shuffle_ps(a, xy, _MM_SHUFFLE(2, 0, 3, 0));
+    __m128 y = _mm_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+    __m128 z = _mm_shuffle_ps(yz, c, _MM_SHUFFLE(3, 0, 3, 1));
+
+    __m128 l = _mm_mul_ps(x, _mm_set1_ps(LUMINANCE.x));
+#ifdef __FMA__
+    l = _mm_fmadd_ps(y, _mm_set1_ps(LUMINANCE.y), l);
+    return _mm_fmadd_ps(z, _mm_set1_ps(LUMINANCE.z), l);
+#else
+    l = _mm_add_ps(l, _mm_mul_ps(y, _mm_set1_ps(LUMINANCE.y)));
+    return _mm_add_ps(l, _mm_mul_ps(z, _mm_set1_ps(LUMINANCE.z)));
+#endif
+
+}
+
+/**
+ * Natural log of four positive normal values, by Cephes' polynomial for
+ * the mantissa, to about one unit in the last place.
+ */
+static __m128 log4(__m128 v) {
+
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128i bits = _mm_castps_si128(v);
+
+    // v = m * 2^e with m in [1, 2), folded into [sqrt(1/2), sqrt(2))
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_castps_si128(one)));
+    __m128 high = _mm_cmpge_ps(m, _mm_set1_ps(1.41421356f));
+    m = _mm_or_ps(_mm_and_ps(high, _mm_mul_ps(m, _mm_set1_ps(0.5f))), _mm_andnot_ps(high, m));
+    e = _mm_add_ps(e, _mm_and_ps(high, one));
+
+    __m128 x = _mm_sub_ps(m, one);
+    __m128 z = _mm_mul_ps(x, x);
+
+    const float P[9] = { 7.0376836292e-2f, -1.1514610310e-1f, 1.1676998740e-1f, -1.2420140846e-1f, 1.4249322787e-1f,
+                         -1.6668057665e-1f, 2.0000714765e-1f, -2.4999993993e-1f, 3.3333331174e-1f };
+    __m128 y = _mm_set1_ps(P[0]);
+    for (int i = 1; i < 9; i++) {
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(P[i]));
+    }
+    y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+
+    // log(2) split in two so the exponent term adds without rounding
+    y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+    y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+    return _mm_add_ps(_mm_add_ps(x, y), _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+
+}
+
+#endif
+
+/**
+ * Weights of a Gaussian truncated at three standard deviations, from the
+ * center outwards, normalized over both sides.
+ * @param sigma standard deviation in pixels
+ */
+static vector<float> getKernel(float sigma) {
+
+    int radius = std::max(1, (int) std::ceil(3 * sigma));
+    vector<float> kernel(radius + 1);
+    float sum = 0;
+
+    for (int t = 0; t <= radius; t++) {
+        kernel[t] = std::exp(-(t * t) / (2 * sigma * sigma));
+        sum += (t == 0) ? kernel[t] : 2 * kernel[t];
+    }
+
+    for (float& weight : kernel) {
+        weight /= sum;
+    }
+
+    return kernel;
+
+}
 
 /**
- * Get photometric luminance from an RGB value.
+ * Filter one line of a separable blur from the lines at each offset
+ * around it, which are rows for a vertical pass or shifted copies of one
+ * row for a horizontal pass.
+ * @param lines line at each offset t in [-radius, radius], at lines[radius + t]
+ * @param kernel weights from the center outwards
+ * @param out output line
+ * @param count length of a line
+ */
+static void filterLine(const float* const* lines, const vector<float>& kernel, float* out, size_t count) {
+
+    int radius = kernel.size() - 1;
+    const float* const* center = lines + radius;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4) {
+        __m128 sum = _mm_mul_ps(_mm_set1_ps(kernel[0]), _mm_loadu_ps(center[0] + i));
+        for (int t = 1; t <= radius; t++) {
+            __m128 pair = _mm_add_ps(_mm_loadu_ps(center[-t] + i), _mm_loadu_ps(center[t] + i));
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(kernel[t]), pair));
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+#endif
+
+    for (; i < count; i++) {
+        float sum = kernel[0] * center[0][i];
+        for (int t = 1; t <= radius; t++) {
+            sum += kernel[t] * (center[-t][i] + center[t][i]);
+        }
+        out[i] = sum;
+    }
+
+}
+
+/**
+ * Gaussian blur of an image, repeating its edges.
+ * @param in image to blur
+ * @param out blurred image
+ * @param temp scratch image of the same size
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @param sigma standard deviation in pixels
+ * @param pool threads to blur on, or null
+ */
+static void blur(const float* in, float* out, float* temp, size_t height, size_t width, float sigma, ThreadPool* pool) {
+
+    vector<float> kernel = getKernel(sigma);
+    int radius = kernel.size() - 1;
+    size_t rows = std::max((size_t) 1, TONE_CHUNK / width);
+
+    // horizontal pass over each row padded by its end values
+    forChunks(height, rows, pool, [&](size_t, size_t first, size_t count) {
+
+        vector<float> padded(width + 2 * radius);
+        vector<const float*> lines(2 * radius + 1);
+        for (int t = 0; t <= 2 * radius; t++) {
+            lines[t] = padded.data() + t;
+        }
+
+        for (size_t y = first; y < first + count; y++) {
+            const float* row = in + y * width;
+            std::fill(padded.begin(), padded.begin() + radius, row[0]);
+            std::copy(row, row + width, padded.begin() + radius);
+            std::fill(padded.end() - radius, padded.end(), row[width - 1]);
+            filterLine(lines.data(), kernel, temp + y * width, width);
+        }
+
+    });
+
+    // vertical pass, repeating the first and last rows
+    forChunks(height, rows, pool, [&](size_t, size_t first, size_t count) {
+
+        vector<const float*> lines(2 * radius + 1);
+
+        for (size_t y = first; y < first + count; y++) {
+            for (int t = -radius; t <= radius; t++) {
+                long row = std::min(std::max((long) y + t, 0L), (long) height - 1);
+                lines[radius + t] = temp + row * width;
+            }
+            filterLine(lines.data(), kernel, out + y * width, width);
+        }
+
+    });
+
+}
+
+/**
+ * Halve an image by averaging each 2x2 block, repeating the last row and
+ * column of odd sizes.
+ * @param in image to halve
+ * @param height height of image in pixels
+ * @param width width of image in pixels
+ * @param out output image of (height + 1) / 2 by (width + 1) / 2 pixels
+ * @param pool threads to run on, or null
+ */
+static void downsample(const float* in, size_t height, size_t width, float* out, ThreadPool* pool) {
+
+    size_t h = (height + 1) / 2;
+    size_t w = (width + 1) / 2;
+
+    forChunks(h, std::max((size_t) 1, TONE_CHUNK / w), pool, [&](size_t, size_t first, size_t count) {
+        for (size_t y = first; y < first + count; y++) {
+            const float* top = in + 2 * y * width;
+            const float* bottom = in + std::min(2 * y + 1, height - 1) * width;
+            for (size_t x = 0; x < w; x++) {
+                size_t left = 2 * x;
+                size_t right = std::min(2 * x + 1, width - 1);
+                out[y * w + x] = 0.25f * ((top[left] + top[right]) + (bottom[left] + bottom[right]));
+            }
+        }
+    });
+
+}
+
+/**
+ * Find where a full resolution pixel falls between two samples of a level
+ * of the pyramid.
+ * @param i full resolution pixel index
+ * @param factor level's downscale
+ * @param size level's size along the axis
+ * @param first output nearer sample
+ * @param second output farther sample
+ * @return weight of the farther sample
+ */
+static float getSpan(size_t i, size_t factor, size_t size, size_t& first, size_t& second) {
+
+    float c = (i + 0.5f) / factor - 0.5f;
+    if (c <= 0) {
+        first = second = 0;
+        return 0;
+    }
+
+    first = std::min((size_t) c, size - 1);
+    second = std::min(first + 1, size - 1);
+    return c - first;
+
+}
+
+/**
+ * Bilinearly resample a level of the pyramid at full resolution.
+ * @param in level image
+ * @param h height of level in pixels
+ * @param w width of level in pixels
+ * @param factor level's downscale
+ * @param out full resolution image
+ * @param height full height in pixels
+ * @param width full width in pixels
+ * @param pool threads to run on, or null
+ */
+static void upsample(const float* in, size_t h, size_t w, size_t factor, float* out, size_t height, size_t width, ThreadPool* pool) {
+
+    vector<size_t> left(width), right(width);
+    vector<float> weight(width);
+    for (size_t x = 0; x < width; x++) {
+        weight[x] = getSpan(x, factor, w, left[x], right[x]);
+    }
+
+    forChunks(height, std::max((size_t) 1, TONE_CHUNK / width), pool, [&](size_t, size_t first, size_t count) {
+        for (size_t y = first; y < first + count; y++) {
+            size_t top, bottom;
+            float v = getSpan(y, factor, h, top, bottom);
+            const float* a = in + top * w;
+            const float* b = in + bottom * w;
+            for (size_t x = 0; x < width; x++) {
+                float upper = a[left[x]] + weight[x] * (a[right[x]] - a[left[x]]);
+                float lower = b[left[x]] + weight[x] * (b[right[x]] - b[left[x]]);
+                out[y * width + x] = upper + v * (lower - upper);
+            }
+        }
+    });
+
+}
+
+/**
+ * Get photometric luminance from an RGB value. Where FMA is available the
+ * sum is fused explicitly, since otherwise the compiler may or may not
+ * contract it and getLuminance4 could not match.
  * @param tri RGB triple
  * @return photometric value
  */
 float ToneOperator::getLuminance(glm::vec3 tri) {
-    return glm::dot(tri, glm::vec3(0.27f, 0.67f, 0.06f));
+    float l = tri.x * LUMINANCE.x;
+#ifdef __FMA__
+    l = std::fma(tri.y, LUMINANCE.y, l);
+    return std::fma(tri.z, LUMINANCE.z, l);
+#else
+    l = l + tri.y * LUMINANCE.y;
+    return l + tri.z * LUMINANCE.z;
+#endif
 }
 
 /**
  * Get the maximum photometric luminance in an image.
  * @param frame a frame buffer
  * @param size array size of buffer
+ * @param pool threads to search on, or null
  * @return photometric value
  */
-float ToneOperator::getMaxLuminance(glm::vec3* frame, size_t size) {
+float ToneOperator::getMaxLuminance(glm::vec3* frame, size_t size, ThreadPool* pool) {
+
+    vector<float> partial((size + TONE_CHUNK - 1) / TONE_CHUNK);
+
+    forChunks(size, TONE_CHUNK, pool, [&](size_t chunk, size_t first, size_t count) {
+
+        glm::vec3* pixels = frame + first;
+        float maxval = 0;
+        size_t i = 0;
+
+#ifdef __SSE2__
+        __m128 lanes = _mm_setzero_ps();
+        for (; i + 4 <= count; i += 4) {
+            lanes = _mm_max_ps(lanes, getLuminance4(&pixels[i].x));
+        }
+        alignas(16) float values[4];
+        _mm_store_ps(values, lanes);
+        for (int k = 0; k < 4; k++) {
+            maxval = std::max(maxval, values[k]);
+        }
+#endif
+
+        for (; i < count; i++) {
+            maxval = std::max(maxval, getLuminance(pixels[i]));
+        }
+
+        partial[chunk] = maxval;
+
+    });
 
     // find maximum intensity component
     float maxval = 0;
-    float lum;
-
-    for (size_t i = 0; i < size; i++) {
-        lum = getLuminance(frame[i]);
-        if (lum > maxval) { maxval = lum; }
+    for (float value : partial) {
+        maxval = std::max(maxval, value);
     }
 
     return maxval;
@@ -35,99 +382,353 @@ float ToneOperator::getMaxLuminance(glm::vec3* frame, size_t size) {
  * Get the log average luminance in a scene.
  * @param frame a frame buffer
  * @param size array size of buffer
+ * @param pool threads to sum on, or null
  * @return log average
  */
-float ToneOperator::getLogAverage(glm::vec3* frame, size_t size) {
+float ToneOperator::getLogAverage(glm::vec3* frame, size_t size, ThreadPool* pool) {
 
-    // find maximum intensity component
-    float sum = 0;
-    for (size_t i = 0; i < size; i++) {
-        sum += glm::log(0.001f + getLuminance(frame[i]));
-        
+    vector<double> partial((size + TONE_CHUNK - 1) / TONE_CHUNK);
+
+    forChunks(size, TONE_CHUNK, pool, [&](size_t chunk, size_t first, size_t count) {
+
+        glm::vec3* pixels = frame + first;
+        double sum = 0;
+        size_t i = 0;
+
+#ifdef __SSE2__
+        __m128d low = _mm_setzero_pd();
+        __m128d high = _mm_setzero_pd();
+        for (; i + 4 <= count; i += 4) {
+            __m128 l = log4(_mm_add_ps(_mm_set1_ps(0.001f), getLuminance4(&pixels[i].x)));
+            low = _mm_add_pd(low, _mm_cvtps_pd(l));
+            high = _mm_add_pd(high, _mm_cvtps_pd(_mm_movehl_ps(l, l)));
+        }
+        alignas(16) double values[4];
+        _mm_store_pd(values, low);
+        _mm_store_pd(values + 2, high);
+        sum = (values[0] + values[1]) + (values[2] + values[3]);
+#endif
+
+        for (; i < count; i++) {
+            sum += std::log(0.001f + getLuminance(pixels[i]));
+        }
+
+        partial[chunk] = sum;
+
+    });
+
+    // sum chunks in order, so the result does not depend on scheduling
+    double sum = 0;
+    for (double value : partial) {
+        sum += value;
     }
 
-    return glm::exp(sum / (float) size);
+    return (float) std::exp(sum / size);
 
 }
 
 /**
- * Apply a simple linear scaling from 0 to the scene's max value.
+ * Map pixels with the fitted operator.
+ * @param pixels pixels to map
+ * @param output mapped pixels, which may be the input
+ * @param count number of pixels
+ * @param pool threads to map on, or null
+ */
+void ToneOperator::map(glm::vec3* pixels, glm::vec3* output, size_t count, ThreadPool* pool) {
+    forChunks(count, TONE_CHUNK, pool, [&](size_t, size_t first, size_t n) {
+        transform(pixels + first, output + first, n);
+    });
+}
+
+/**
+ * Map pixels with the fitted operator straight to 8-bit codes, a block
+ * small enough to stay in cache at a time.
+ * @param pixels pixels to map
+ * @param codes output codes, three per pixel
+ * @param count number of pixels
+ * @param quantizer quantizer of the output format
+ * @param pool threads to map on, or null
+ */
+void ToneOperator::map(glm::vec3* pixels, uint8_t* codes, size_t count, Quantizer& quantizer, ThreadPool* pool) {
+    forChunks(count, TONE_CHUNK, pool, [&](size_t, size_t first, size_t n) {
+        glm::vec3 block[TONE_BLOCK];
+        for (size_t i = 0; i < n; i += TONE_BLOCK) {
+            size_t m = std::min((size_t) TONE_BLOCK, n - i);
+            transform(pixels + first + i, block, m);
+            quantizer.quantize(&block[0].x, codes + 3 * (first + i), 3 * m);
+        }
+    });
+}
+
+/**
+ * Fit the operator to a frame and map it in place.
  * @param frame an image
  * @param h height
  * @param w width
- * @return a tone mapped image
+ * @param pool threads to map on, or null
+ */
+void ToneOperator::apply(glm::vec3* frame, size_t h, size_t w, ThreadPool* pool) {
+    fit(frame, h * w, pool);
+    map(frame, frame, h * w, pool);
+}
+
+/**
+ * Find the scene's max value for a simple linear scaling.
+ * @param frame a frame buffer
+ * @param size array size of buffer
+ * @param pool threads to search on, or null
  */
-glm::vec3* LinearModel::apply(glm::vec3* frame, size_t h, size_t w) {
+void LinearModel::fit(glm::vec3* frame, size_t size, ThreadPool* pool) {
 
     // get max luminance component
-    float max = getMaxLuminance(frame, h * w);
+    max = getMaxLuminance(frame, size, pool);
 
-    // create output buffer
-    glm::vec3* output = new glm::vec3[h * w];
+}
 
-    // store scaled value
-    for (int i = 0; i < h * w; i++) {
-        output[i] = frame[i] / max * MAX_DISP_LUM;
+/**
+ * Apply a simple linear scaling from 0 to the scene's max value.
+ * @param pixels pixels to map
+ * @param output mapped pixels, which may be the input
+ * @param count number of pixels
+ */
+void LinearModel::transform(glm::vec3* pixels, glm::vec3* output, size_t count) {
+
+    const float* in = &pixels[0].x;
+    float* out = &output[0].x;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 4 <= 3 * count; i += 4) {
+        __m128 v = _mm_div_ps(_mm_loadu_ps(in + i), _mm_set1_ps(max));
+        _mm_storeu_ps(out + i, _mm_mul_ps(v, _mm_set1_ps(MAX_DISP_LUM)));
     }
+#endif
 
-    return output;
+    // store scaled value
+    for (; i < 3 * count; i++) {
+        out[i] = in[i] / max * MAX_DISP_LUM;
+    }
 
 }
 
 /**
- * Apply Ward's perceptual tone reproduction operator.
- * @param frame an image
- * @param h height
- * @param w width
- * @return a tone mapped image
+ * Find Ward's scale factor from a frame's log average luminance.
+ * @param frame a frame buffer
+ * @param size array size of buffer
+ * @param pool threads to sum on, or null
  */
-glm::vec3* WardModel::apply(glm::vec3* frame, size_t h, size_t w) {
+void WardModel::fit(glm::vec3* frame, size_t size, ThreadPool* pool) {
 
-    // get max luminance
-    float logavg = getLogAverage(frame, h * w);
+    // get log average luminance
+    float logavg = getLogAverage(frame, size, pool);
 
     // ward scale factor
-    float sf = pow((1.219f + pow(MAX_DISP_LUM / 2.0f, 0.4f) / 1.219f + pow(logavg, 0.4f)), 2.5f);
+    sf = pow((1.219f + pow(MAX_DISP_LUM / 2.0f, 0.4f) / 1.219f + pow(logavg, 0.4f)), 2.5f);
+
+}
+
+/**
+ * Apply Ward's perceptual tone reproduction operator.
+ * @param pixels pixels to map
+ * @param output mapped pixels, which may be the input
+ * @param count number of pixels
+ */
+void WardModel::transform(glm::vec3* pixels, glm::vec3* output, size_t count) {
 
-    // create output buffer
-    glm::vec3* output = new glm::vec3[h * w];
+    const float* in = &pixels[0].x;
+    float* out = &output[0].x;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 4 <= 3 * count; i += 4) {
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), _mm_set1_ps(sf)));
+    }
+#endif
 
     // store scaled value
-    for (int i = 0; i < h * w; i++) {
-        for (int axis = 0; axis < 3; axis++) {
-            output[i][axis] = frame[i][axis] * sf;
-        }
+    for (; i < 3 * count; i++) {
+        out[i] = in[i] * sf;
     }
 
-    return output;
+}
+
+/**
+ * Find Reinhard's scale factor from a frame's log average luminance.
+ * @param frame a frame buffer
+ * @param size array size of buffer
+ * @param pool threads to sum on, or null
+ */
+void ReinhardModel::fit(glm::vec3* frame, size_t size, ThreadPool* pool) {
+
+    // get log average luminance
+    float logavg = getLogAverage(frame, size, pool);
+
+    // reinhard scale factor
+    sf = gray / logavg;
 
 }
 
 /**
  * Apply Reinhard's photographic tone reproduction operator.
+ * @param pixels pixels to map
+ * @param output mapped pixels, which may be the input
+ * @param count number of pixels
+ */
+void ReinhardModel::transform(glm::vec3* pixels, glm::vec3* output, size_t count) {
+
+    const float* in = &pixels[0].x;
+    float* out = &output[0].x;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 4 <= 3 * count; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(in + i), _mm_set1_ps(sf));
+        v = _mm_div_ps(v, _mm_add_ps(_mm_set1_ps(1.0f), v));
+        _mm_storeu_ps(out + i, _mm_mul_ps(v, _mm_set1_ps(MAX_DISP_LUM)));
+    }
+#endif
+
+    // store scaled value
+    for (; i < 3 * count; i++) {
+        out[i] = (in[i] * sf) / (1.0f + (in[i] * sf)) * MAX_DISP_LUM;
+    }
+
+}
+
+/**
+ * @param gray key the scene's log average is mapped to
+ * @param sharpness how sharply contrast must stand out to end a
+ *        neighbourhood; larger values allow wider neighbourhoods
+ * @param threshold largest center-surround difference, relative to the
+ *        center, a neighbourhood may have
+ */
+LocalReinhardModel::LocalReinhardModel(float gray, float sharpness, float threshold) {
+    this->gray = gray;
+    this->sharpness = sharpness;
+    this->threshold = threshold;
+}
+
+/**
+ * Find the scale factor from a frame's log average luminance.
+ * @param frame a frame buffer
+ * @param size array size of buffer
+ * @param pool threads to sum on, or null
+ */
+void LocalReinhardModel::fit(glm::vec3* frame, size_t size, ThreadPool* pool) {
+
+    // get log average luminance
+    float logavg = getLogAverage(frame, size, pool);
+
+    // reinhard scale factor
+    sf = gray / logavg;
+
+}
+
+/**
+ * Apply the global operator the local one reduces to, in which every
+ * neighbourhood is the pixel itself.
+ * @param pixels pixels to map
+ * @param output mapped pixels, which may be the input
+ * @param count number of pixels
+ */
+void LocalReinhardModel::transform(glm::vec3* pixels, glm::vec3* output, size_t count) {
+
+    for (size_t i = 0; i < count; i++) {
+        float l = sf * getLuminance(pixels[i]);
+        output[i] = pixels[i] * (sf / (1.0f + l) * MAX_DISP_LUM);
+    }
+
+}
+
+/**
+ * Apply Reinhard's local photographic operator to a frame in place.
+ * Scales grow by 1.6 from one pixel, and a scale s is a Gaussian of
+ * standard deviation s / 4. Each pixel keeps the largest scale before the
+ * first whose blur differs from the next by more than the threshold.
  * @param frame an image
  * @param h height
  * @param w width
- * @return a tone mapped image
+ * @param pool threads to run on, or null
  */
-glm::vec3* ReinhardModel::apply(glm::vec3* frame, size_t h, size_t w) {
+void LocalReinhardModel::apply(glm::vec3* frame, size_t h, size_t w, ThreadPool* pool) {
 
-    // get max luminance
-    float logavg = getLogAverage(frame, h * w);
+    size_t size = h * w;
+    fit(frame, size, pool);
 
-    // reinhard scale factor
-    float sf = gray / logavg;
+    // scaled luminance heads a pyramid of halved copies
+    vector<vector<float>> pyramid(1, vector<float>(size));
+    vector<size_t> heights(1, h), widths(1, w);
+    forChunks(size, TONE_CHUNK, pool, [&](size_t, size_t first, size_t count) {
+        for (size_t i = first; i < first + count; i++) {
+            pyramid[0][i] = sf * getLuminance(frame[i]);
+        }
+    });
 
-    // create output buffer
-    glm::vec3* output = new glm::vec3[h * w];
+    // blurs at the previous and current scale, and the blur each pixel keeps
+    vector<float> previous(size), current(size), chosen(size), temp(size);
+    vector<uint8_t> active(size, 1);
+    vector<float> level, levelTemp;
 
-    // store scaled value
-    for (int i = 0; i < h * w; i++) {
-        for (int axis = 0; axis < 3; axis++) {
-            output[i][axis] = (frame[i][axis] * sf) / (1.0f + (frame[i][axis] * sf)) * MAX_DISP_LUM;
+    for (int i = 0; i <= LOCAL_SCALES; i++) {
+
+        float scale = std::pow(1.6f, i);
+        float sigma = scale / 4;
+
+        // coarsest level whose pixels are no wider than the deviation
+        size_t k = 0;
+        while (sigma >= (float) (2 << k) && (heights[k] > 1 || widths[k] > 1)) {
+            if (++k == pyramid.size()) {
+                heights.push_back((heights[k - 1] + 1) / 2);
+                widths.push_back((widths[k - 1] + 1) / 2);
+                pyramid.push_back(vector<float>(heights[k] * widths[k]));
+                downsample(pyramid[k - 1].data(), heights[k - 1], widths[k - 1], pyramid[k].data(), pool);
+            }
+        }
+
+        if (k == 0) {
+            blur(pyramid[0].data(), current.data(), temp.data(), h, w, sigma, pool);
+        } else {
+            // averaging 2x2 blocks down to a factor f blurs by (f^2 - 1) / 12 square pixels already
+            size_t factor = (size_t) 1 << k;
+            float remaining = std::sqrt(std::max(sigma * sigma - (factor * factor - 1) / 12.0f, 0.0f)) / factor;
+            level.resize(heights[k] * widths[k]);
+            levelTemp.resize(level.size());
+            blur(pyramid[k].data(), level.data(), levelTemp.data(), heights[k], widths[k], remaining, pool);
+            upsample(level.data(), heights[k], widths[k], factor, current.data(), h, w, pool);
         }
+
+        if (i == 0) {
+            chosen = current;
+        } else {
+
+            // center-surround difference at the previous scale
+            float bias = std::pow(2.0f, sharpness) * gray / ((scale / 1.6f) * (scale / 1.6f));
+
+            forChunks(size, TONE_CHUNK, pool, [&](size_t, size_t first, size_t count) {
+                for (size_t p = first; p < first + count; p++) {
+                    if (!active[p]) {
+                        continue;
+                    }
+                    float v = (previous[p] - current[p]) / (bias + previous[p]);
+                    if (std::fabs(v) < threshold) {
+                        chosen[p] = previous[p];
+                    } else {
+                        active[p] = 0;
+                    }
+                }
+            });
+
+        }
+
+        std::swap(previous, current);
+
     }
 
-    return output;
+    // compress each pixel against its neighbourhood
+    forChunks(size, TONE_CHUNK, pool, [&](size_t, size_t first, size_t count) {
+        for (size_t p = first; p < first + count; p++) {
+            frame[p] = frame[p] * (sf / (1.0f + chosen[p]) * MAX_DISP_LUM);
+        }
+    });
 
-}
\ No newline at end of file
+}
@@ -1,19 +1,43 @@
 #pragma once
 
+#include <cstdint>
+#include <cstddef>
 #include <glm/vec3.hpp>
 
 // maximum display luminance
 #define MAX_DISP_LUM 100.0f
 
+// pixels tone mapped by each task
+#define TONE_CHUNK (1 << 16)
+
+// center-surround scales compared by the local operator
+#define LOCAL_SCALES 8
+
+class ThreadPool;
+class Quantizer;
+
+/**
+ * Maps rendered radiance to display values in [0, MAX_DISP_LUM]. An
+ * operator is first fit to a frame's statistics and then maps pixels with
+ * them, so a frame can be mapped in bands as it is finished. Frames are
+ * processed in chunks of TONE_CHUNK pixels, in parallel when given a pool,
+ * and reductions combine the chunks in order so results do not depend on
+ * the thread count.
+ */
 class ToneOperator {
 
     protected:
         float getLuminance(glm::vec3 tri);
-        float getMaxLuminance(glm::vec3* frame, size_t size);
-        float getLogAverage(glm::vec3* frame, size_t size);
+        float getMaxLuminance(glm::vec3* frame, size_t size, ThreadPool* pool = nullptr);
+        float getLogAverage(glm::vec3* frame, size_t size, ThreadPool* pool = nullptr);
+        virtual void transform(glm::vec3* pixels, glm::vec3* output, size_t count) = 0;
 
     public:
-        virtual glm::vec3* apply(glm::vec3* frame, size_t h, size_t w) = 0;
+        virtual ~ToneOperator() = default;
+        virtual void fit(glm::vec3* frame, size_t size, ThreadPool* pool = nullptr) = 0;
+        void map(glm::vec3* pixels, glm::vec3* output, size_t count, ThreadPool* pool = nullptr);
+        void map(glm::vec3* pixels, uint8_t* codes, size_t count, Quantizer& quantizer, ThreadPool* pool = nullptr);
+        virtual void apply(glm::vec3* frame, size_t h, size_t w, ThreadPool* pool = nullptr);
 
 };
 
@@ -22,8 +46,14 @@ class ToneOperator {
  */
 class LinearModel : public ToneOperator {
 
+    private:
+        float max = 1;
+
+    protected:
+        virtual void transform(glm::vec3* pixels, glm::vec3* output, size_t count) override;
+
     public:
-        virtual glm::vec3* apply(glm::vec3* frame, size_t h, size_t w) override;
+        virtual void fit(glm::vec3* frame, size_t size, ThreadPool* pool = nullptr) override;
 
 };
 
@@ -32,8 +62,14 @@ class LinearModel : public ToneOperator {
  */
 class WardModel : public ToneOperator {
 
+    private:
+        float sf = 1;
+
+    protected:
+        virtual void transform(glm::vec3* pixels, glm::vec3* output, size_t count) override;
+
     public:
-        virtual glm::vec3* apply(glm::vec3* frame, size_t h, size_t w) override;
+        virtual void fit(glm::vec3* frame, size_t size, ThreadPool* pool = nullptr) override;
 
 };
 
@@ -44,8 +80,41 @@ class ReinhardModel : public ToneOperator {
 
     private:
         float gray = 0.18;
+        float sf = 1;
+
+    protected:
+        virtual void transform(glm::vec3* pixels, glm::vec3* output, size_t count) override;
+
+    public:
+        virtual void fit(glm::vec3* frame, size_t size, ThreadPool* pool = nullptr) override;
+
+};
+
+/**
+ * Reinhard's local photographic operator, which dodges and burns: each
+ * pixel is compressed against the average of the largest neighbourhood
+ * around it with no strong contrast, so bright windows and dark interiors
+ * both keep their detail. Neighbourhoods are Gaussian blurs of the scaled
+ * luminance at LOCAL_SCALES + 1 scales, each computed at the coarsest level
+ * of a pyramid of halved copies that still resolves it, so the cost is
+ * linear in the pixel count at any scale. Needs the whole frame, so bands
+ * mapped on their own, as when streaming, use the global operator it
+ * reduces to.
+ */
+class LocalReinhardModel : public ToneOperator {
+
+    private:
+        float gray;
+        float sharpness;
+        float threshold;
+        float sf = 1;
+
+    protected:
+        virtual void transform(glm::vec3* pixels, glm::vec3* output, size_t count) override;
 
     public:
-        virtual glm::vec3* apply(glm::vec3* frame, size_t h, size_t w) override;
+        LocalReinhardModel(float gray = 0.18f, float sharpness = 8.0f, float threshold = 0.05f);
+        virtual void fit(glm::vec3* frame, size_t size, ThreadPool* pool = nullptr) override;
+        virtual void apply(glm::vec3* frame, size_t h, size_t w, ThreadPool* pool = nullptr) override;
 
 };
\ No newline at end of file
@@ -0,0 +1,712 @@
+#include <vector>
+#include <algorithm>
+#include <bitset>
+#include <glm/common.hpp>
+
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "wide.h"
+#include "bvh.h"
+#include "object.h"
+#include "cache.h"
+
+using std::vector;
+
+/**
+ * @return surface area of a box
+ */
+static float getArea(BoundingBox& box) {
+    glm::vec3 size = box.max - box.min;
+    return 2 * (size.x * size.y + size.x * size.z + size.y * size.z);
+}
+
+/**
+ * Test a ray against every child box of a node, limited to [0, tmax].
+ * @param node node to test
+ * @param ray ray to trace
+ * @param tmax distance to the nearest hit so far
+ * @param tnear output entry distance for each child
+ * @return bit mask of children hit
+ */
+template <int N>
+static int intersectChildren(const WideNode<N>& node, const Ray& ray, float tmax, float* tnear) {
+
+    const float* near[3] = { ray.sign[0] ? node.maxX : node.minX, ray.sign[1] ? node.maxY : node.minY, ray.sign[2] ? node.maxZ : node.minZ };
+    const float* far[3] = { ray.sign[0] ? node.minX : node.maxX, ray.sign[1] ? node.minY : node.maxY, ray.sign[2] ? node.minZ : node.maxZ };
+    int mask = 0;
+
+    for (int i = 0; i < N; i++) {
+
+        float t0 = 0;
+        float t1 = tmax;
+
+        for (int a = 0; a < 3; a++) {
+            float tn = (near[a][i] - ray.origin[a]) * ray.invDirection[a];
+            float tf = (far[a][i] - ray.origin[a]) * ray.invDirection[a];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+
+        tnear[i] = t0;
+        mask |= (t0 <= t1) << i;
+
+    }
+
+    return mask;
+
+}
+
+#ifdef __SSE__
+
+/**
+ * SSE version of the child box test for 4-wide nodes.
+ */
+template <>
+int intersectChildren<4>(const WideNode<4>& node, const Ray& ray, float tmax, float* tnear) {
+
+    const float* near[3] = { ray.sign[0] ? node.maxX : node.minX, ray.sign[1] ? node.maxY : node.minY, ray.sign[2] ? node.maxZ : node.minZ };
+    const float* far[3] = { ray.sign[0] ? node.minX : node.maxX, ray.sign[1] ? node.minY : node.maxY, ray.sign[2] ? node.minZ : node.maxZ };
+
+    // max/min return the second operand on NaN, keeping the interval as is
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = _mm_set1_ps(tmax);
+
+    for (int a = 0; a < 3; a++) {
+        __m128 origin = _mm_set1_ps(ray.origin[a]);
+        __m128 inv = _mm_set1_ps(ray.invDirection[a]);
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near[a]), origin), inv), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far[a]), origin), inv), t1);
+    }
+
+    _mm_storeu_ps(tnear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+
+}
+
+#endif
+
+#ifdef __AVX__
+
+/**
+ * AVX version of the child box test for 8-wide nodes.
+ */
+template <>
+int intersectChildren<8>(const WideNode<8>& node, const Ray& ray, float tmax, float* tnear) {
+
+    const float* near[3] = { ray.sign[0] ? node.maxX : node.minX, ray.sign[1] ? node.maxY : node.minY, ray.sign[2] ? node.maxZ : node.minZ };
+    const float* far[3] = { ray.sign[0] ? node.minX : node.maxX, ray.sign[1] ? node.minY : node.maxY, ray.sign[2] ? node.minZ : node.maxZ };
+
+    // max/min return the second operand on NaN, keeping the interval as is
+    __m256 t0 = _mm256_setzero_ps();
+    __m256 t1 = _mm256_set1_ps(tmax);
+
+    for (int a = 0; a < 3; a++) {
+        __m256 origin = _mm256_set1_ps(ray.origin[a]);
+        __m256 inv = _mm256_set1_ps(ray.invDirection[a]);
+        t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near[a]), origin), inv), t0);
+        t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far[a]), origin), inv), t1);
+    }
+
+    _mm256_storeu_ps(tnear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+
+}
+
+#endif
+
+/**
+ * Create a wide BVH of a set of primitives.
+ * @param list primitives to be contained in hierarchy
+ * @param pool threads to build subtrees on, or null to build serially
+ */
+template <int N>
+WideBVH<N>::WideBVH(vector<Primitive*>* list, ThreadPool* pool) {
+
+    // cache primitive bounds
+    vector<BVHPrimitive> refs = vector<BVHPrimitive>(list->size());
+    for (size_t i = 0; i < list->size(); i++) {
+        refs[i].index = i;
+        refs[i].bound = (*list)[i]->getBounds();
+        refs[i].centroid = (refs[i].bound.min + refs[i].bound.max) * 0.5f;
+    }
+
+    if (refs.empty()) {
+        return;
+    }
+
+    // build binary hierarchy, then reorder primitives so leaves are contiguous
+    BVHBuildNode* root = new BVHBuildNode(refs, 0, refs.size(), pool, 1);
+
+    primitives.resize(refs.size());
+    for (size_t i = 0; i < refs.size(); i++) {
+        primitives[i] = (*list)[refs[i].index];
+    }
+
+    collapse(root, 1);
+    delete root;
+    geometry.build(&primitives);
+
+    stats.nodes = nodes.size();
+    stats.references = primitives.size();
+    stats.bytes = nodes.size() * sizeof(WideNode<N>) + primitives.size() * sizeof(Primitive*) + geometry.getBytes();
+
+}
+
+/**
+ * Pack a binary subtree into wide nodes. Children are gathered by repeatedly
+ * opening the interior child with the largest surface area until N are held.
+ * @param node node to collapse; a leaf only at the root of a tiny tree
+ * @param depth depth of node
+ * @return index of the packed node
+ */
+template <int N>
+uint32_t WideBVH<N>::collapse(BVHBuildNode* node, size_t depth) {
+
+    uint32_t index = nodes.size();
+    nodes.push_back(WideNode<N>());
+    stats.depth = std::max(stats.depth, depth);
+
+    vector<BVHBuildNode*> children;
+    if (node->count > 0) {
+        children.push_back(node);
+    } else {
+        children.push_back(node->children[0]);
+        children.push_back(node->children[1]);
+    }
+
+    while (children.size() < N) {
+
+        int largest = -1;
+        float area = -1;
+
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i]->count == 0 && getArea(children[i]->bound) > area) {
+                area = getArea(children[i]->bound);
+                largest = i;
+            }
+        }
+
+        if (largest < 0) {
+            break;
+        }
+
+        // replace in place to keep children in spatial order
+        BVHBuildNode* open = children[largest];
+        children[largest] = open->children[1];
+        children.insert(children.begin() + largest, open->children[0]);
+
+    }
+
+    for (int i = 0; i < N; i++) {
+
+        WideNode<N>& wide = nodes[index];
+
+        if (i >= (int) children.size()) {
+            // unused slot
+            wide.minX[i] = wide.minY[i] = wide.minZ[i] = INFINITY;
+            wide.maxX[i] = wide.maxY[i] = wide.maxZ[i] = -INFINITY;
+            wide.ref[i] = 0;
+            wide.count[i] = 0;
+            continue;
+        }
+
+        BoundingBox& b = children[i]->bound;
+        wide.minX[i] = b.min.x;
+        wide.minY[i] = b.min.y;
+        wide.minZ[i] = b.min.z;
+        wide.maxX[i] = b.max.x;
+        wide.maxY[i] = b.max.y;
+        wide.maxZ[i] = b.max.z;
+        wide.count[i] = children[i]->count;
+
+        if (children[i]->count > 0) {
+            wide.ref[i] = children[i]->first;
+            Geometry::sort(primitives, children[i]->first, children[i]->count);
+            stats.leaves++;
+        } else {
+            // recursion may reallocate the node array
+            uint32_t child = collapse(children[i], depth + 1);
+            nodes[index].ref[i] = child;
+        }
+
+    }
+
+    return index;
+
+}
+
+/**
+ * Recompute child bounds from the current primitive bounds, keeping the
+ * hierarchy's shape.
+ * @return true, as any BVH can be refit
+ */
+template <int N>
+bool WideBVH<N>::refit() {
+
+    // children always follow their parent, so a reverse sweep sees them first
+    for (size_t i = nodes.size(); i-- > 0;) {
+
+        WideNode<N>& node = nodes[i];
+
+        for (int c = 0; c < N; c++) {
+
+            // unused slots keep their inverted bounds
+            if (node.count[c] == 0 && node.ref[c] == 0) {
+                continue;
+            }
+
+            BoundingBox b = BoundingBox();
+
+            if (node.count[c] > 0) {
+                for (uint32_t j = node.ref[c]; j < node.ref[c] + node.count[c]; j++) {
+                    b.expand(primitives[j]->getBounds());
+                }
+            } else {
+                // the union over every slot, as unused slots are empty boxes
+                const WideNode<N>& child = nodes[node.ref[c]];
+                for (int k = 0; k < N; k++) {
+                    b.expand(BoundingBox(glm::vec3(child.minX[k], child.minY[k], child.minZ[k]),
+                                         glm::vec3(child.maxX[k], child.maxY[k], child.maxZ[k])));
+                }
+            }
+
+            node.minX[c] = b.min.x;
+            node.minY[c] = b.min.y;
+            node.minZ[c] = b.min.z;
+            node.maxX[c] = b.max.x;
+            node.maxY[c] = b.max.y;
+            node.maxZ[c] = b.max.z;
+
+        }
+
+    }
+
+    // primitive data is copied into leaves, so gather it again
+    geometry.build(&primitives);
+    return true;
+
+}
+
+/**
+ * Get size statistics for the hierarchy.
+ * @return node, leaf and reference counts and memory footprint
+ */
+template <int N>
+TreeStats WideBVH<N>::getStats() {
+    return stats;
+}
+
+/**
+ * Write the collapsed hierarchy and its gathered geometry to a cache file,
+ * with the order leaves put the primitives in.
+ * @param out cache file to append to
+ * @param list primitives the hierarchy was built from
+ * @return true
+ */
+template <int N>
+bool WideBVH<N>::save(CacheWriter& out, vector<Primitive*>* list) {
+    vector<uint32_t> order;
+    getOrder(primitives, list, order);
+    out.write(stats);
+    out.writeArray(order);
+    out.writeArray(nodes);
+    geometry.save(out);
+    return true;
+}
+
+/**
+ * Restore a hierarchy written by save, checking every child and leaf range
+ * and the depth so a damaged file cannot send traversal out of bounds or
+ * past its fixed stack. Unused slots must have inverted bounds, or rays
+ * would enter them and visit the root again.
+ * @param in cache file positioned at the hierarchy
+ * @param list primitives equal to those it was built from, in the same order
+ * @return false if the file is invalid
+ */
+template <int N>
+bool WideBVH<N>::load(CacheReader& in, vector<Primitive*>* list) {
+
+    vector<uint32_t> order;
+    if (!in.read(stats) || !in.readArray(order) || !in.readArray(nodes) || !applyOrder(order, list, primitives)
+        || !geometry.load(in, &primitives)) {
+        return false;
+    }
+
+    // children follow their parents, so a node's depth is known when reached
+    vector<uint32_t> depth(nodes.size(), 0);
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+
+        const WideNode<N>& node = nodes[i];
+        if (depth[i] >= BVH_MAX_DEPTH) {
+            return false;
+        }
+
+        for (int c = 0; c < N; c++) {
+            uint32_t ref = node.ref[c];
+            uint32_t count = node.count[c];
+            bool empty = node.minX[c] > node.maxX[c] && node.minY[c] > node.maxY[c] && node.minZ[c] > node.maxZ[c];
+            bool valid = (count > 0) ? (size_t) ref + count <= primitives.size() && geometry.isSorted(ref, count)
+                                     : (ref == 0) ? empty : ref > i && ref < nodes.size();
+            if (!valid) {
+                return false;
+            }
+            if (count == 0 && ref != 0) {
+                depth[ref] = std::max(depth[ref], depth[i] + 1);
+            }
+        }
+
+    }
+
+    stats.buildBytes = 0;
+    return true;
+
+}
+
+/**
+ * Perform an intersection test on the hierarchy.
+ * @param ray ray to trace
+ * @param tmax distance beyond which hits are ignored
+ * @return nearest intersection along ray, with no object if none is nearer
+ *         than tmax
+ */
+template <int N>
+Hit WideBVH<N>::intersect(const Ray& ray, float tmax) {
+
+    Hit hit;
+    hit.object = nullptr;
+
+    if (nodes.empty()) {
+        return hit;
+    }
+
+    float min = tmax;
+    traverse(ray, 0, 0, hit, min);
+    hit.point = ray.origin + ray.direction * min;
+    hit.distance = min;
+    return hit;
+
+}
+
+/**
+ * Trace a single ray through a subtree. Children hit by the ray are pushed
+ * far to near, and entries beyond the nearest hit are skipped.
+ * @param ray ray to trace
+ * @param ref index of the subtree root, or first primitive if it is a leaf
+ * @param count primitives in the leaf, or 0 for a node
+ * @param hit nearest hit so far, updated in place
+ * @param min distance to nearest hit so far, updated in place
+ */
+template <int N>
+void WideBVH<N>::traverse(const Ray& ray, uint32_t ref, uint32_t count, Hit& hit, float& min) {
+
+    typedef struct Entry {
+        uint32_t ref;
+        uint32_t count;
+        float t;
+    } Entry;
+
+    Entry stack[BVH_MAX_DEPTH * N];
+    int top = 0;
+    stack[top++] = { ref, count, 0 };
+
+    while (top > 0) {
+
+        Entry entry = stack[--top];
+
+        if (entry.t > min) {
+            continue;
+        }
+
+        if (entry.count > 0) {
+
+            // find closest intersection in leaf
+            geometry.intersect(ray, entry.ref, entry.count, min, hit);
+
+            continue;
+
+        }
+
+        const WideNode<N>& node = nodes[entry.ref];
+        float tnear[N];
+        int mask = intersectChildren<N>(node, ray, min, tnear);
+        int first = top;
+
+        // insert hit children so the nearest ends up on top
+        for (int i = 0; i < N; i++) {
+
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+
+            int j = top++;
+            while (j > first && stack[j - 1].t < tnear[i]) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+
+            stack[j] = { node.ref[i], node.count[i], tnear[i] };
+
+        }
+
+    }
+
+}
+
+/**
+ * Trace a packet of rays together. The packet shares each node fetch and
+ * stack entry, and every active ray tests all children of a node at once.
+ * Children are pushed with the rays that hit them, ordered by the nearest
+ * entry among those rays. Once few rays remain active they finish the
+ * subtree one by one.
+ * @param rays rays to trace
+ * @param count number of rays, at most PACKET_SIZE
+ * @param hits output nearest intersection for each ray
+ */
+template <int N>
+void WideBVH<N>::intersectPacket(const Ray* rays, int count, Hit* hits) {
+
+    typedef struct Entry {
+        uint32_t ref;
+        uint32_t count;
+        uint32_t mask;
+        float t;
+    } Entry;
+
+    float min[PACKET_SIZE];
+
+    for (int i = 0; i < count; i++) {
+        hits[i] = Hit();
+        min[i] = INFINITY;
+    }
+
+    if (nodes.empty()) {
+        return;
+    }
+
+    Entry stack[BVH_MAX_DEPTH * N];
+    int top = 0;
+    stack[top++] = { 0, 0, (count >= 32) ? ~0u : (1u << count) - 1, 0 };
+
+    while (top > 0) {
+
+        Entry entry = stack[--top];
+
+        // rays whose nearest hit precedes the entry are done with it
+        uint32_t active = 0;
+        for (int i = 0; i < count; i++) {
+            if ((entry.mask & (1u << i)) && !(entry.t > min[i])) {
+                active |= 1u << i;
+            }
+        }
+
+        if (active == 0) {
+            continue;
+        }
+
+        if (std::bitset<32>(active).count() <= PACKET_SPLIT) {
+
+            // rays have diverged, finish this subtree individually
+            for (int i = 0; i < count; i++) {
+                if (active & (1u << i)) {
+                    traverse(rays[i], entry.ref, entry.count, hits[i], min[i]);
+                }
+            }
+
+            continue;
+
+        }
+
+        if (entry.count > 0) {
+
+            // find closest intersection in leaf for each active ray
+            for (int i = 0; i < count; i++) {
+                if (active & (1u << i)) {
+                    geometry.intersect(rays[i], entry.ref, entry.count, min[i], hits[i]);
+                }
+            }
+
+            continue;
+
+        }
+
+        // test each active ray against every child at once, gathering the rays per child
+        const WideNode<N>& node = nodes[entry.ref];
+        uint32_t masks[N] = {};
+        float nearest[N];
+        float tnear[N];
+
+        for (int i = 0; i < N; i++) {
+            nearest[i] = INFINITY;
+        }
+
+        for (int k = 0; k < count; k++) {
+
+            if (!(active & (1u << k))) {
+                continue;
+            }
+
+            int mask = intersectChildren<N>(node, rays[k], min[k], tnear);
+
+            for (int i = 0; i < N; i++) {
+                if (mask & (1 << i)) {
+                    masks[i] |= 1u << k;
+                    nearest[i] = std::min(nearest[i], tnear[i]);
+                }
+            }
+
+        }
+
+        // insert hit children so the nearest ends up on top
+        int first = top;
+
+        for (int i = 0; i < N; i++) {
+
+            if (masks[i] == 0) {
+                continue;
+            }
+
+            int j = top++;
+            while (j > first && stack[j - 1].t < nearest[i]) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+
+            stack[j] = { node.ref[i], node.count[i], masks[i], nearest[i] };
+
+        }
+
+    }
+
+    for (int i = 0; i < count; i++) {
+        hits[i].point = rays[i].origin + rays[i].direction * min[i];
+        hits[i].distance = min[i];
+    }
+
+}
+
+/**
+ * Test whether anything lies along a ray segment, stopping at the first
+ * intersection found. Children are visited in storage order.
+ * @param ray ray to trace
+ * @param tmax length of the segment
+ * @return true if some primitive is hit within (0, tmax)
+ */
+template <int N>
+bool WideBVH<N>::occluded(const Ray& ray, float tmax) {
+
+    if (nodes.empty()) {
+        return false;
+    }
+
+    uint32_t stack[BVH_MAX_DEPTH * N];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+
+        const WideNode<N>& node = nodes[stack[--top]];
+        float tnear[N];
+        int mask = intersectChildren<N>(node, ray, tmax, tnear);
+
+        for (int i = 0; i < N; i++) {
+
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+
+            if (node.count[i] == 0) {
+                stack[top++] = node.ref[i];
+                continue;
+            }
+
+            if (geometry.occluded(ray, node.ref[i], node.count[i], tmax)) {
+                return true;
+            }
+
+        }
+
+    }
+
+    return false;
+
+}
+
+/**
+ * Test a packet of ray segments for blockers together. A ray leaves the
+ * packet once it is blocked, and traversal ends when every ray is.
+ * @param rays rays to trace
+ * @param tmax length of each segment
+ * @param count number of rays, at most PACKET_SIZE
+ * @param blocked output whether each segment is blocked
+ */
+template <int N>
+void WideBVH<N>::occludedPacket(const Ray* rays, const float* tmax, int count, bool* blocked) {
+
+    typedef struct Entry {
+        uint32_t node;
+        uint32_t mask;
+    } Entry;
+
+    for (int i = 0; i < count; i++) {
+        blocked[i] = false;
+    }
+
+    if (nodes.empty()) {
+        return;
+    }
+
+    Entry stack[BVH_MAX_DEPTH * N];
+    int top = 0;
+    uint32_t open = (count >= 32) ? ~0u : (1u << count) - 1;
+    stack[top++] = { 0, open };
+
+    while (top > 0) {
+
+        Entry entry = stack[--top];
+        const WideNode<N>& node = nodes[entry.node];
+        uint32_t masks[N] = {};
+        float tnear[N];
+
+        for (int k = 0; k < count; k++) {
+            if (entry.mask & open & (1u << k)) {
+                int mask = intersectChildren<N>(node, rays[k], tmax[k], tnear);
+                for (int i = 0; i < N; i++) {
+                    masks[i] |= (uint32_t) ((mask >> i) & 1) << k;
+                }
+            }
+        }
+
+        for (int i = 0; i < N; i++) {
+
+            if (masks[i] == 0) {
+                continue;
+            }
+
+            if (node.count[i] == 0) {
+                stack[top++] = { node.ref[i], masks[i] };
+                continue;
+            }
+
+            // any hit within its segment retires a ray
+            for (int k = 0; k < count; k++) {
+                if ((masks[i] & open & (1u << k)) && geometry.occluded(rays[k], node.ref[i], node.count[i], tmax[k])) {
+                    blocked[k] = true;
+                    open &= ~(1u << k);
+                }
+            }
+
+            if (open == 0) {
+                return;
+            }
+
+        }
+
+    }
+
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "accel.h"
+#include "scene.h"
+#include "geometry.h"
+
+class BVHBuildNode;
+class Primitive;
+class ThreadPool;
+
+using std::vector;
+
+/**
+ * Node of an N-wide BVH. Child bounds are stored as structure of arrays so a
+ * ray can be tested against all children with one sequence of SIMD
+ * instructions. A child with a nonzero count is a leaf covering that many
+ * primitives from ref; otherwise ref is the index of a child node. Unused
+ * slots have inverted bounds that no ray can hit.
+ */
+template <int N>
+struct alignas(32) WideNode {
+    float minX[N], minY[N], minZ[N];
+    float maxX[N], maxY[N], maxZ[N];
+    uint32_t ref[N];
+    uint32_t count[N];
+};
+
+/**
+ * BVH with N children per node, collapsed from a binned SAH binary BVH.
+ * N = 4 uses SSE and N = 8 uses AVX box tests when available, otherwise a
+ * scalar loop over the children.
+ */
+template <int N>
+class WideBVH : public Accelerator {
+
+    private:
+        vector<WideNode<N>> nodes;
+        vector<Primitive*> primitives;
+        Geometry geometry;
+        TreeStats stats;
+        uint32_t collapse(BVHBuildNode* node, size_t depth);
+        void traverse(const Ray& ray, uint32_t ref, uint32_t count, Hit& hit, float& min);
+
+    public:
+        WideBVH() = default;
+        WideBVH(vector<Primitive*>* list, ThreadPool* pool = nullptr);
+        virtual TreeStats getStats() override;
+        virtual Hit intersect(const Ray& ray, float tmax = INFINITY) override;
+        virtual bool occluded(const Ray& ray, float tmax) override;
+        virtual void intersectPacket(const Ray* rays, int count, Hit* hits) override;
+        virtual void occludedPacket(const Ray* rays, const float* tmax, int count, bool* blocked) override;
+        virtual bool refit() override;
+        virtual bool save(CacheWriter& out, vector<Primitive*>* list) override;
+        virtual bool load(CacheReader& in, vector<Primitive*>* list) override;
+
+};